@@ -21,10 +21,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/select.h>
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
+#ifdef HAVE_XCB
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#endif
 #include <SDL.h>
 #include <SDL_syswm.h>
 
@@ -32,678 +41,4455 @@
 #include <X11/extensions/XShm.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#ifdef HAVE_XCB
+#include <xcb/shm.h>
+#endif
 #endif
 
 #include "SDL_haa.h"
+#include "SDL_haa_trace.h"
+#include "SDL_haa_pixels.h"
 #include "atoms.inc"
 
+/** Maximum number of separate rectangles a single flip will upload. */
+#define MAX_FLIP_RECTS 32
+/** Size of the tiles compared by HAA_ACTOR_AUTO_DAMAGE, in pixels. */
+#define DAMAGE_TILE 32
+/** Rectangles HAA_ACTOR_AUTO_DAMAGE collects before merging them. */
+#define MAX_DAMAGE_RUNS (4 * MAX_FLIP_RECTS)
+
+#ifdef HAVE_XSHM
+/** A free range inside a shared memory slab. */
+typedef struct HAA_ShmBlock {
+	size_t offset, size;
+	struct HAA_ShmBlock *next;
+} HAA_ShmBlock;
+
+/** A shared memory segment, attached once, that many images are carved from. */
+typedef struct HAA_ShmSlab {
+	XShmSegmentInfo shminfo;
+	size_t size;
+	HAA_ShmBlock *free; /**< Sorted by offset. */
+	int used; /**< Number of allocated blocks. */
+	/** Attached read-write, as shared memory pixmaps need. */
+	Bool writable;
+	/** The same segment, attached to the submission thread connection. */
+	XShmSegmentInfo submit_shminfo;
+	struct HAA_ShmSlab *next;
+} HAA_ShmSlab;
+#endif
+
+/** One of the (at most two) images an actor can be drawn from. */
+typedef struct HAA_Buffer {
+	XImage *image;
+	/** Bytes of memory behind image->data; may be more than it uses. */
+	size_t size;
+#ifdef HAVE_XSHM
+	HAA_ShmSlab *slab;
+	size_t offset;
+	/** Shared memory pixmap on the same memory, used as window background. */
+	Pixmap pixmap;
+	/** Serial of the last XShmPutImage request reading from this buffer. */
+	unsigned long serial;
+#endif
+	/** True while the X server (or in threaded mode, the submission
+	  * thread) may still be reading from this buffer. */
+	Bool busy;
+} HAA_Buffer;
+
+/** How the surface pixels reach the images. */
+typedef enum HAA_Convert {
+	HAA_CONVERT_NONE,	/**< The surface points into the image. */
+	HAA_CONVERT_8888_565,
+	HAA_CONVERT_8888_565_DITHER,
+	HAA_CONVERT_565_8888,
+	HAA_CONVERT_PREMULTIPLY,
+	HAA_CONVERT_BLIT	/**< Anything else; left to SDL. */
+} HAA_Convert;
+
 typedef struct HAA_ActorPriv {
 	HAA_Actor p;
 
 	Window window, parent;
 	Visual *visual;
 	Colormap colormap;
-	XImage *image;
+	HAA_Buffer buffers[2];
+	int num_buffers;
+	int back; /**< Index of the buffer the surface currently points to. */
+	HAA_Convert convert;
+	/** With conversion, the surface pixels (owned by us). */
+	void *pixels;
+	/** With HAA_CONVERT_BLIT, a surface over the back buffer image. */
+	SDL_Surface *image_surface;
+	/** With conversion and double buffering, the regions of the previous
+	  * flip, which the new back buffer has not seen yet. */
+	SDL_Rect prev_rects[MAX_FLIP_RECTS];
+	int prev_numrects;
+	/** Regions touched by HAA_Fill and friends since the last flip. */
+	SDL_Rect damage[MAX_FLIP_RECTS];
+	int numdamage;
 	GC gc;
-#ifdef HAVE_XSHM
-	XShmSegmentInfo shminfo;
-#endif
 	unsigned char ready;
+	HAA_Error error; /**< First X error caused by this actor. */
+	/** Unmapped by the compositor restart recovery, not yet mapped again. */
+	Bool restarting;
+	/** When the actor was last moved to a new parent while ready, or 0. */
+	Uint32 reparent_time;
+	/** With a group, the public properties are relative to it. */
+	struct HAA_Group *group;
+	/** Frames uploaded by HAA_SetFrames, in a grid of frames_per_row. */
+	Pixmap frames;
+	int num_frames, frames_per_row;
+	/** With HAA_ACTOR_AUTO_DAMAGE, the surface as last flipped;
+	  * same pitch as the surface. */
+	Uint8 *shadow;
+	Bool shadow_valid;
+
+	/** Creation parameters, to find compatible actors in the pool. */
+	Uint32 flags;
+	int width, height, bpp;
+
+	/** What we last told the compositor, to avoid resending it. */
+	HAA_Actor sent;
+	Window sent_parent;
+	/** HAA_PENDING_* bits for which the shadow copy above is valid. */
+	Uint8 sent_valid;
+
+	/** Threaded mode: what the submission thread knows about the actor.
+	  * Together with the shadow copy above, only touched by that thread. */
+	HAA_Actor submit_props;
+	Uint8 submit_pending;
+	unsigned char submit_ready;
+	Window submit_parent;
+
+#ifndef HAA_NO_STATS
+	HAA_Stats stats;
+#endif
 	struct HAA_ActorPriv *prev, *next;
 } HAA_ActorPriv;
 
 static Display *display;
 static Window parent_window;
 static HAA_ActorPriv *first = NULL, *last = NULL;
+/** Freed actors kept for reuse, linked by their next pointer. */
+static HAA_ActorPriv *pool_first = NULL;
+static int pool_count, pool_max_actors;
+static Uint32 pool_bytes, pool_max_bytes;
+static void pool_trim(void);
+static void timelines_forget(HAA_ActorPriv* actor);
+static void groups_committed(void);
+static void frame_fence_send(Display *dpy, Window fence);
+static Bool frame_fence_returned(Window window);
+static void actor_send_pending(HAA_ActorPriv* actor, const HAA_Actor *p,
+	Window parent, Uint8 pending);
+static int submit_start(void);
+static void submit_stop(void);
+
+/** A value a property must reach at some point of a timeline. */
+typedef struct HAA_Keyframe {
+	HAA_Property property;
+	Uint32 time;
+	Sint32 value;
+	HAA_Easing easing;
+} HAA_Keyframe;
+
+struct HAA_Timeline {
+	HAA_ActorPriv *actor;
+	HAA_Keyframe *keyframes; /**< Sorted by time. */
+	int num_keyframes;
+	int loops; /**< Loops to play when started, or 0 to loop forever. */
+	int loops_left; /**< Remaining loops while running. */
+	Uint32 start;
+	Bool running;
+	struct HAA_Timeline *next;
+};
+
+/** Every created timeline. */
+static HAA_Timeline *timelines = NULL;
+
+struct HAA_Group {
+	HAA_Actor t; /**< Transform of the group; surface is always NULL. */
+	HAA_ActorPriv **children;
+	int num_children, max_children;
+	struct HAA_Group *next;
+};
+
+/** Every created group. */
+static HAA_Group *groups = NULL;
+
+/** Properties of a child that depend on the group transform. */
+#define GROUP_PENDING (HAA_PENDING_POSITION | HAA_PENDING_SCALE | \
+	HAA_PENDING_ROTATION_Z | HAA_PENDING_SHOW)
+
+struct HAA_FrameClock {
+	Uint32 interval; /**< Target time between frames, in ms. */
+	Uint32 next_frame; /**< When the next frame should begin. */
+	int skip; /**< Extra intervals to wait between frames, when lagging. */
+	/** Time the server took to get through the last measured frame. */
+	Uint32 latency;
+	/** Unmapped window whose property changes come back as events once
+	  * the server is done with everything sent before them. */
+	Window fence;
+	Uint32 fence_sent; /**< When the outstanding fence was sent. */
+	Bool fence_pending, fence_done, fence_overdue;
+	struct HAA_FrameClock *next;
+};
+
+/** Every created frame clock. */
+static HAA_FrameClock *clocks = NULL;
+
+/** Most frames the clock will skip in a row when the server lags. */
+#define MAX_FRAME_SKIP 4
+
+/** Set between HAA_BeginFrame and HAA_EndFrame;
+  * commits are then delayed until the end of the frame. */
+static Bool in_frame;
 
-/* Queued reparents. */
-static Uint32 queued_reparent_time;
+/** Monotonic time in microseconds. */
+static Uint64 monotonic_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (Uint64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#ifndef HAA_NO_STATS
+static HAA_GlobalStats stats;
+
+/** Adds to a counter of both the actor and the global totals. */
+#define STAT_ADD(actor, field, n) \
+	do { (actor)->stats.field += (n); stats.actors.field += (n); } while (0)
+#define STAT_GLOBAL_ADD(field, n) \
+	do { stats.field += (n); } while (0)
+
+#define stat_time() monotonic_us()
+
+/** Adds the time since start to a latency histogram. */
+static void stat_latency(Uint32 histogram[HAA_LATENCY_BUCKETS], Uint64 start)
+{
+	Uint64 us = stat_time() - start;
+	int bucket = 0;
+
+	/* The first bucket whose limit of 2^bucket us is above it. */
+	while (bucket < HAA_LATENCY_BUCKETS - 1 && us >= ((Uint64) 1 << bucket)) {
+		bucket++;
+	}
+
+	histogram[bucket]++;
+}
+#else
+#define STAT_ADD(actor, field, n) do { } while (0)
+#define STAT_GLOBAL_ADD(field, n) do { } while (0)
+#define stat_time() 0
+#define stat_latency(histogram, start) do { (void)(start); } while (0)
+#endif
+
+/** Maps actor windows to their HAA_ActorPriv. */
+static XContext actor_context;
+
+/* Protocol trace; see SDL_haa_trace.h. */
+static FILE *trace_file;
+static Uint64 trace_last;
+
+/* Reparent waiting for its new parent to be mapped. */
+static Bool queued_reparent;
 static Bool queued_reparent_fs;
+/* SDL windows we get map notifications from. */
+static Window watched_fswindow, watched_wmwindow;
+
+/* Compositor restart recovery: when to map the actors again, or 0. */
+static Uint32 restart_remap_time;
+/* Wakes up the app's event loop until the actors are mapped again. */
+static SDL_TimerID restart_timer;
+/** How long to leave a restarting compositor alone, in ms. */
+#define RESTART_BACKOFF 500
+/** How long after a reparent losing the ready flag means the compositor
+  * dropped the actor along with its old parent, in ms. */
+#define REPARENT_TIMEOUT 1000
+
+/* Asynchronous error tracking. */
+static Bool async_errors;
+static int (*prev_error_handler)(Display *, XErrorEvent *);
+
+/** A range of request serials sent on behalf of an actor. */
+typedef struct HAA_RequestSpan {
+	unsigned long first, last;
+	HAA_ActorPriv *actor; /**< NULL once the actor is freed. */
+	HAA_Operation op;
+} HAA_RequestSpan;
+
+/** Initial size of the span ring; it grows while the server lags. */
+#define MIN_REQUEST_SPANS 64
+/** Spans the server may still report errors for, oldest first,
+  * in a ring of span_capacity entries. */
+static HAA_RequestSpan *request_spans;
+static unsigned int span_capacity, span_head, span_count;
 
 #ifdef HAVE_XSHM
 static int shm_major, shm_minor;
 static Bool shm_pixmaps;
 static Bool have_shm;
+static int shm_event_base;
+static HAA_ShmSlab *slabs;
+
+/** Usual size of the shared memory slabs; bigger images get their own. */
+#define SHM_SLAB_SIZE (4 * 1024 * 1024)
+/** Alignment of images, and each of their rows, inside a slab. */
+#define SHM_ALIGN 64
 #else
 static const Bool have_shm = False;
 #endif
 
-int HAA_Init(Uint32 flags)
-{
-	SDL_SysWMinfo info;
-
-	SDL_VERSION(&info.version);
-	if (SDL_GetWMInfo(&info) != 1) {
-		SDL_SetError("SDL_haa is incompatible with this SDL version");
-		return -1;
-	}
-
-	display = info.info.x11.display;
-	parent_window = 0;
-	queued_reparent_time = 0;
-	first = last = NULL;
+/* Threaded mode: a second X connection, only used by the submission
+ * thread, which executes the commands other threads post to a queue. */
+static Display *submit_display;
+static SDL_Thread *submit_thread;
+/** Protects the busy flag of buffers and waits for commands to be done. */
+static SDL_mutex *submit_lock;
+static SDL_cond *submit_cond;
+/** Written to when the queue becomes non-empty, to wake the thread up. */
+static int submit_wake[2];
+#ifdef HAVE_XSHM
+static int submit_shm_event_base;
+#endif
+/** Protects the actor list against threads other than the main one. */
+static SDL_mutex *actors_lock;
 
-	XInternAtoms(display, (char**)atom_names, ATOM_COUNT, True, atom_values);
+typedef enum HAA_CommandType {
+	HAA_CMD_ADD,
+	HAA_CMD_REMOVE,
+	HAA_CMD_STATE,
+	HAA_CMD_COMMIT,
+	HAA_CMD_FLIP,
+	HAA_CMD_FRAME,
+	HAA_CMD_FENCE,
+	HAA_CMD_SYNC,
+#ifdef HAVE_XSHM
+	HAA_CMD_SHM_ATTACH,
+	HAA_CMD_SHM_DETACH,
+#endif
+	HAA_CMD_QUIT
+} HAA_CommandType;
 
+typedef struct HAA_Command {
+	HAA_CommandType type;
+	HAA_ActorPriv *actor;
+	union {
+		/** HAA_CMD_COMMIT: the committed properties. */
+		HAA_Actor props;
+		/** HAA_CMD_STATE: the compositor state of the actor changed. */
+		struct {
+			Window parent;
+			unsigned char ready;
+			Uint8 resend; /**< HAA_PENDING_* bits to send again. */
+			Bool forget; /**< The compositor forgot everything. */
+		} state;
+		/** HAA_CMD_FLIP */
+		struct {
+			int buffer, numrects;
+			SDL_Rect rects[MAX_FLIP_RECTS];
+		} flip;
+		/** HAA_CMD_FRAME: the frame to show. */
+		int frame;
+		/** HAA_CMD_FENCE: the frame clock fence window. */
+		Window fence;
 #ifdef HAVE_XSHM
-	have_shm = XShmQueryVersion(display, &shm_major, &shm_minor, &shm_pixmaps);
+		/** HAA_CMD_SHM_ATTACH, HAA_CMD_SHM_DETACH */
+		HAA_ShmSlab *slab;
 #endif
+	} u;
+	/** True while the thread that posted the command waits for it. */
+	volatile Bool sync;
+	struct HAA_Command *next;
+} HAA_Command;
 
-	/* This might add some noise to your event queue, but we need them. */
-	SDL_EventState(SDL_SYSWMEVENT, SDL_ENABLE);
+/** Lock-free multiple producer, single consumer queue:
+  * producers push to this stack, the submission thread takes it whole. */
+static HAA_Command * volatile submit_queue;
 
-	return 0;
+/** The connection messages and images are sent through. */
+static Display* out_display(void)
+{
+	return submit_display ? submit_display : display;
 }
 
-void HAA_Quit()
+static void lock_actors(void)
 {
-	/* Nothing to do for now */
+	if (actors_lock) SDL_mutexP(actors_lock);
 }
 
-static HAA_ActorPriv* find_actor_for_window(Window w)
+static void unlock_actors(void)
 {
-	HAA_ActorPriv* a;
+	if (actors_lock) SDL_mutexV(actors_lock);
+}
 
-	for (a = first; a; a = a->next) {
-		if (a->window == w) {
-			return a;
+static int error_handler(Display *d, XErrorEvent *e)
+{
+	if (d == submit_display) {
+		/* Requests from the submission thread are not attributed to actors. */
+		return 0;
+	}
+
+	if (d == display) {
+		unsigned int i;
+		/* Search from the most recent span backwards. */
+		for (i = span_count; i > 0; i--) {
+			HAA_RequestSpan *span = &request_spans[
+				(span_head + i - 1) % span_capacity];
+			if ((long)(e->serial - span->first) >= 0 &&
+					(long)(span->last - e->serial) >= 0) {
+				HAA_Error *error;
+				/* Caused by an actor freed since; nobody cares now. */
+				if (!span->actor) return 0;
+				error = &span->actor->error;
+				if (error->operation == HAA_OP_NONE) {
+					/* Keep only the first one; the rest are likely caused by it. */
+					error->operation = span->op;
+					error->error_code = e->error_code;
+					error->request_code = e->request_code;
+					error->minor_code = e->minor_code;
+					error->serial = e->serial;
+				}
+				return 0;
+			}
 		}
 	}
 
-	return NULL;
+	/* Not ours. */
+	return prev_error_handler ? prev_error_handler(d, e) : 0;
 }
 
-static void actor_send_message(HAA_ActorPriv* actor, Atom message_type,
-		Uint32 l0, Uint32 l1, Uint32 l2, Uint32 l3, Uint32 l4)
+/** Call before sending requests on behalf of an actor. */
+static unsigned long track_begin(void)
 {
-	Window window = actor->window;
-	XEvent event = { 0 };
-
-	event.xclient.type = ClientMessage;
-	event.xclient.window = window;
-	event.xclient.message_type = message_type;
-	event.xclient.format = 32;
-	event.xclient.data.l[0] = l0;
-	event.xclient.data.l[1] = l1;
-	event.xclient.data.l[2] = l2;
-	event.xclient.data.l[3] = l3;
-	event.xclient.data.l[4] = l4;
-
-	XSendEvent(display, window, True,
-		StructureNotifyMask,
-		(XEvent *)&event);
+	/* In threaded mode, this might not be the thread owning display. */
+	return submit_display ? 0 : NextRequest(display);
 }
 
-static void reparent_all_to(Window new_parent)
+/** Call after sending requests on behalf of an actor
+  * so that errors caused by them can be attributed to it. */
+static void track_end(HAA_ActorPriv* actor, HAA_Operation op,
+	unsigned long first)
 {
-	HAA_ActorPriv* a;
-	/* video mode has changed */
-	parent_window = new_parent;
+	const unsigned long processed = LastKnownRequestProcessed(display);
+	unsigned long next;
+	HAA_RequestSpan *span;
 
-	/* if we don't have any actors, no need to reparent them */
-	if (first == NULL) {
-		assert(last == NULL);
-		return;
+	if (!async_errors || submit_display) return;
+
+	next = NextRequest(display);
+	if (next == first) return;
+
+	/* Drop spans whose errors, if any, have all been handled already:
+	 * the server went past them. */
+	while (span_count > 0 &&
+			(long)(processed - request_spans[span_head].last) > 0) {
+		span_head = (span_head + 1) % span_capacity;
+		span_count--;
 	}
 
-	/* unmap all actors that were already ready */
-	for (a = first; a; a = a->next) {
-		a->parent = parent_window;
-		if (a->ready) {
-			XUnmapWindow(display, a->window);
+	if (span_count == span_capacity) {
+		unsigned int capacity = span_capacity ?
+			span_capacity * 2 : MIN_REQUEST_SPANS;
+		HAA_RequestSpan *spans = malloc(capacity * sizeof(HAA_RequestSpan));
+		unsigned int i;
+		if (spans) {
+			for (i = 0; i < span_count; i++) {
+				spans[i] = request_spans[(span_head + i) % span_capacity];
+			}
+			free(request_spans);
+			request_spans = spans;
+			span_capacity = capacity;
+			span_head = 0;
+		} else if (span_count > 0) {
+			/* Forget the oldest one rather than this one. */
+			span_head = (span_head + 1) % span_capacity;
+			span_count--;
+		} else {
+			return;
 		}
 	}
 
-	XSync(display, False);
+	span = &request_spans[(span_head + span_count) % span_capacity];
+	span->first = first;
+	span->last = next - 1;
+	span->actor = actor;
+	span->op = op;
+	span_count++;
+}
 
-	/* now remap and reconfigure all actors */
-	for (a = first; a; a = a->next) {
-		if (a->ready) {
-			XMapWindow(display, a->window);
-			a->ready = 0;
-			a->p.pending |= HAA_PENDING_EVERYTHING;
-		} else {
-			a->p.pending |= HAA_PENDING_PARENT | HAA_PENDING_SHOW;
+/** Forget about requests done on behalf of a to be destroyed actor;
+  * errors they cause are still ignored. */
+static void track_forget(HAA_ActorPriv* actor)
+{
+	unsigned int i;
+	for (i = 0; i < span_count; i++) {
+		HAA_RequestSpan *span = &request_spans[(span_head + i) % span_capacity];
+		if (span->actor == actor) {
+			span->actor = NULL;
 		}
 	}
-
-	XFlush(display);
 }
 
-static int auto_reparent_all_to(Bool fullscreen)
+/** Appends a record to the trace file, if tracing. */
+static void trace_record(HAA_TraceType type, const void *payload, size_t size)
 {
-	SDL_SysWMinfo info;
-	Window new_parent;
-	XWindowAttributes attr;
-	Bool is_mapped;
-	int res;
+	HAA_TraceRecordHeader header;
+	Uint64 now, delta;
 
-	SDL_VERSION(&info.version);
-	res = SDL_GetWMInfo(&info);
-	assert(res == 1);
+	if (!trace_file) return;
 
-	/* Delete any pending reparent */
-	queued_reparent_time = 0;
+	/* The submission thread records too. */
+	if (submit_lock) SDL_mutexP(submit_lock);
+	if (trace_file) {
+		now = monotonic_us();
+		delta = now - trace_last;
+		trace_last = now;
 
-	if (fullscreen) {
-		new_parent = info.info.x11.fswindow;
-	} else {
-		new_parent = info.info.x11.wmwindow;
+		header.type = type;
+		header.size = size;
+		header.reserved = 0;
+		header.delta = delta > 0xFFFFFFFFU ? 0xFFFFFFFFU : delta;
+
+		fwrite(&header, sizeof(header), 1, trace_file);
+		fwrite(payload, size, 1, trace_file);
 	}
+	if (submit_lock) SDL_mutexV(submit_lock);
+}
 
-	XGetWindowAttributes(display, new_parent, &attr);
-	is_mapped = attr.map_state == IsViewable;
+static void trace_create(HAA_ActorPriv* actor)
+{
+	HAA_TraceCreate rec = { 0 };
+	if (!trace_file) return;
+	rec.window = actor->window;
+	rec.width = actor->width;
+	rec.height = actor->height;
+	rec.bpp = actor->bpp;
+	trace_record(HAA_TRACE_CREATE, &rec, sizeof(rec));
+}
 
-	/* Do we really need to reparent? */
-	if (new_parent != parent_window) {
-		/* Yes, we do. */
-		if (is_mapped) {
-			reparent_all_to(new_parent);
-			return 0;
-		} else {
-			return 1;
-		}
-	} else if (!is_mapped) {
-		/* We don't actually need to reparent,
-		 * but we found that our current parent has been unmapped! */
-		parent_window = 0; // Make current one it invalid
-		return 1; // Signal failure
-	} else {
-		/* We don't need to reparent and everything is OK. */
-		return 0;
-	}
+static void trace_resize(HAA_ActorPriv* actor)
+{
+	HAA_TraceResize rec;
+	if (!trace_file) return;
+	rec.window = actor->window;
+	rec.width = actor->width;
+	rec.height = actor->height;
+	trace_record(HAA_TRACE_RESIZE, &rec, sizeof(rec));
 }
 
-static void handle_queued_reparent()
+/** Records a destroy, map or unmap of an actor window. */
+static void trace_window(HAA_TraceType type, Window window)
 {
-	if (queued_reparent_time) {
-		/* A reparent is pending. */
-		Uint32 now = SDL_GetTicks();
-		if (now > queued_reparent_time) {
-			/* Try to do the queued reparent now. */
-			int res = auto_reparent_all_to(queued_reparent_fs);
-			if (res != 0) {
-				/* Failed to reparent? Try again in 200 ms. */
-				queued_reparent_time = now + 200;
-			}
-		}
-	}
+	HAA_TraceWindow rec;
+	if (!trace_file) return;
+	rec.window = window;
+	trace_record(type, &rec, sizeof(rec));
 }
 
-static void queue_auto_reparent_to(Bool fullscreen, Uint32 delay)
+static void trace_upload(HAA_ActorPriv* actor, HAA_TraceUploadMode mode,
+	const SDL_Rect *rect)
 {
-	queued_reparent_time = SDL_GetTicks() + delay;
-	queued_reparent_fs = fullscreen;
+	HAA_TraceUpload rec = { 0 };
+	if (!trace_file) return;
+	rec.window = actor->window;
+	rec.x = rect->x;
+	rec.y = rect->y;
+	rec.w = rect->w;
+	rec.h = rect->h;
+	rec.mode = mode;
+	rec.bpp = actor->buffers[actor->back].image->bits_per_pixel;
+	trace_record(HAA_TRACE_UPLOAD, &rec, sizeof(rec));
 }
 
-int HAA_SetVideoMode()
+/** XSync, keeping count of how long we spend waiting for the server. */
+static void wait_for_server(void)
 {
-	SDL_Surface *screen = SDL_GetVideoSurface();
+#ifndef HAA_NO_STATS
+	const Bool timed = True;
+#else
+	const Bool timed = trace_file != NULL;
+#endif
+	Uint64 start = timed ? monotonic_us() : 0, elapsed;
 
-	if (!screen) {
-		SDL_SetError("Failed to get current video surface");
-		return 1;
+	XSync(display, False);
+	if (!timed) return;
+
+	elapsed = monotonic_us() - start;
+	STAT_GLOBAL_ADD(syncs, 1);
+	STAT_GLOBAL_ADD(sync_time, elapsed);
+	if (trace_file) {
+		HAA_TraceSync rec;
+		rec.duration = elapsed > 0xFFFFFFFFU ? 0xFFFFFFFFU : elapsed;
+		trace_record(HAA_TRACE_SYNC, &rec, sizeof(rec));
 	}
+}
 
-	auto_reparent_all_to(screen->flags & SDL_FULLSCREEN ? True : False);
+/** Waits for the server to process everything, or just flushes if
+  * the only reason to wait would be catching errors and those are being
+  * tracked asynchronously. In threaded mode, commits and flips are sent
+  * by the submission thread, so there is nothing to wait for. */
+static void sync_display(Bool must_wait)
+{
+	if (submit_display) return;
 
-	return 0;
+	if (must_wait || !async_errors) {
+		wait_for_server();
+	} else {
+		XFlush(display);
+	}
 }
 
-static void HAA_Pending(HAA_ActorPriv* actor)
+static HAA_Command* submit_new(HAA_CommandType type, HAA_ActorPriv* actor)
 {
-	const Uint16 pending = actor->p.pending;
+	HAA_Command *cmd = malloc(sizeof(HAA_Command));
+	if (!cmd) {
+		SDL_Error(SDL_ENOMEM);
+		return NULL;
+	}
+	cmd->type = type;
+	cmd->actor = actor;
+	cmd->sync = False;
+	return cmd;
+}
 
-	if (!actor->ready) return; //Enqueue and wait
+/** Queues a command for the submission thread; never blocks. */
+static void submit_post(HAA_Command *cmd)
+{
+	HAA_Command *head;
 
-	if (pending & HAA_PENDING_ANCHOR) {
-		 actor_send_message(actor,
-		 	ATOM(_HILDON_ANIMATION_CLIENT_MESSAGE_ANCHOR),
-			actor->p.gravity, actor->p.anchor_x, actor->p.anchor_y, 0, 0);
-	}
-	if (pending & HAA_PENDING_POSITION) {
-		 actor_send_message(actor,
-		 	ATOM(_HILDON_ANIMATION_CLIENT_MESSAGE_POSITION),
-			actor->p.position_x, actor->p.position_y, actor->p.depth, 0, 0);
-	}
+	do {
+		head = submit_queue;
+		cmd->next = head;
+	} while (!__sync_bool_compare_and_swap(&submit_queue, head, cmd));
 
-	if (pending & HAA_PENDING_ROTATION_X) {
-		 actor_send_message(actor,
-		 	ATOM(_HILDON_ANIMATION_CLIENT_MESSAGE_ROTATION),
-			HAA_X_AXIS,
-			actor->p.x_rotation_angle,
-			0, actor->p.x_rotation_y, actor->p.x_rotation_z);
-	}
-	if (pending & HAA_PENDING_ROTATION_Y) {
-		 actor_send_message(actor,
-		 	ATOM(_HILDON_ANIMATION_CLIENT_MESSAGE_ROTATION),
-			HAA_Y_AXIS,
-			actor->p.y_rotation_angle,
-			actor->p.y_rotation_x, 0, actor->p.y_rotation_z);
-	}
-	if (pending & HAA_PENDING_ROTATION_Z) {
-		 actor_send_message(actor,
-		 	ATOM(_HILDON_ANIMATION_CLIENT_MESSAGE_ROTATION),
-			HAA_Z_AXIS,
-			actor->p.z_rotation_angle,
-			actor->p.z_rotation_x, actor->p.z_rotation_y, 0);
+	if (!head) {
+		/* The queue was empty, so the thread may be sleeping. */
+		const char c = 0;
+		if (write(submit_wake[1], &c, 1) < 0) {
+			/* Pipe full: it has plenty of wake ups already. */
+		}
 	}
+}
 
-	if (pending & HAA_PENDING_SCALE) {
-		 actor_send_message(actor,
-		 	ATOM(_HILDON_ANIMATION_CLIENT_MESSAGE_SCALE),
-			actor->p.scale_x, actor->p.scale_y, 0, 0, 0);
-	}
+/** Queues a command and waits until the submission thread is done with it. */
+static void submit_call(HAA_Command *cmd)
+{
+	cmd->sync = True;
+	submit_post(cmd);
 
-	if (pending & HAA_PENDING_PARENT) {
-		 actor_send_message(actor,
-			ATOM(_HILDON_ANIMATION_CLIENT_MESSAGE_PARENT),
-			actor->parent, 0, 0, 0, 0);
-	}
-	if (pending & HAA_PENDING_SHOW) {
-		 actor_send_message(actor,
-		 	ATOM(_HILDON_ANIMATION_CLIENT_MESSAGE_SHOW),
-			actor->p.visible, actor->p.opacity, 0, 0, 0);
+	SDL_mutexP(submit_lock);
+	while (cmd->sync) {
+		SDL_CondWait(submit_cond, submit_lock);
 	}
-
-	actor->p.pending = HAA_PENDING_NOTHING;
+	SDL_mutexV(submit_lock);
 }
 
-/** Push a SDL_VIDEOEXPOSE event to the queue */
-static void sdl_expose()
+/** Waits until the server has processed everything the submission thread
+  * has sent so far. */
+static void submit_sync(void)
 {
-	SDL_Event events[32];
+	HAA_Command cmd;
+	cmd.type = HAA_CMD_SYNC;
+	cmd.actor = NULL;
+	submit_call(&cmd);
+}
 
-	/* Pull out all old refresh events */
-	SDL_PeepEvents(events, sizeof(events)/sizeof(events[0]),
-		SDL_GETEVENT, SDL_VIDEOEXPOSEMASK);
+/** The point of an actor its anchor refers to, in actor coordinates. */
+static void actor_anchor_point(const HAA_ActorPriv* actor, int *x, int *y)
+{
+	const int w = actor->width, h = actor->height;
 
-	/* Post the event, if desired */
-	if ( SDL_EventState(SDL_VIDEOEXPOSE, SDL_QUERY) == SDL_ENABLE ) {
-		SDL_Event event;
-		event.type = SDL_VIDEOEXPOSE;
-		SDL_PushEvent(&event);
+	switch (actor->p.gravity) {
+		case HAA_GRAVITY_N:			*x = w / 2;	*y = 0;		break;
+		case HAA_GRAVITY_NE:		*x = w;		*y = 0;		break;
+		case HAA_GRAVITY_E:			*x = w;		*y = h / 2;	break;
+		case HAA_GRAVITY_SE:		*x = w;		*y = h;		break;
+		case HAA_GRAVITY_S:			*x = w / 2;	*y = h;		break;
+		case HAA_GRAVITY_SW:		*x = 0;		*y = h;		break;
+		case HAA_GRAVITY_W:			*x = 0;		*y = h / 2;	break;
+		case HAA_GRAVITY_NW:		*x = 0;		*y = 0;		break;
+		case HAA_GRAVITY_CENTER:	*x = w / 2;	*y = h / 2;	break;
+		default:
+			*x = actor->p.anchor_x;
+			*y = actor->p.anchor_y;
+			break;
 	}
 }
 
-/** Called when the client ready notification is received. */
-static void actor_update_ready(HAA_ActorPriv* actor)
+/** Pending bits of an actor, including those changed by its group. */
+static Uint8 actor_world_pending(const HAA_ActorPriv* actor)
 {
-	Window window = actor->window;
-	int status;
-	Atom actual_type;
-	int actual_format;
-	unsigned long nitems, bytes_after;
-	unsigned char *prop = NULL;
-
-	status = XGetWindowProperty(display, window,
-		ATOM(_HILDON_ANIMATION_CLIENT_READY), 0, 32,
-		False, XA_ATOM,
-		&actual_type, &actual_format,
-		&nitems, &bytes_after, &prop);
+	Uint8 pending = actor->p.pending;
 
-	if (prop) {
-		XFree(prop);
+	if (actor->group && (pending || actor->group->t.pending)) {
+		pending |= GROUP_PENDING;
 	}
 
-	if (status != Success || actual_type != XA_ATOM ||
-			actual_format != 32 || nitems != 1)  {
-		actor->ready = 0;
+	return pending;
+}
+
+/** The properties the compositor should have for an actor: its own, or
+  * those composed with its group transform, stored into world. */
+static const HAA_Actor* actor_world(HAA_ActorPriv* actor, HAA_Actor *world)
+{
+	const HAA_Group *group = actor->group;
+	const HAA_Actor *l = &actor->p, *t;
+	double angle, c, s, x, y;
+	int ax, ay;
+
+	if (!group) return l;
+	t = &group->t;
+
+	/* Where the child anchor lands, relative to the group anchor. */
+	angle = t->z_rotation_angle * (M_PI / 180.0 / 65536.0);
+	c = cos(angle);
+	s = sin(angle);
+	x = (double)(l->position_x - t->anchor_x) * t->scale_x / 65536.0;
+	y = (double)(l->position_y - t->anchor_y) * t->scale_y / 65536.0;
+
+	*world = *l;
+	world->position_x = t->position_x + lround(x * c - y * s);
+	world->position_y = t->position_y + lround(x * s + y * c);
+	world->depth = t->depth + l->depth;
+	world->scale_x = ((Sint64) l->scale_x * t->scale_x) >> 16;
+	world->scale_y = ((Sint64) l->scale_y * t->scale_y) >> 16;
+	world->visible = l->visible && t->visible;
+	world->opacity = (l->opacity * t->opacity + 127) / 255;
+
+	/* Children turn around their anchor, like the group does. */
+	actor_anchor_point(actor, &ax, &ay);
+	world->z_rotation_angle = t->z_rotation_angle + l->z_rotation_angle;
+	world->z_rotation_x = ax;
+	world->z_rotation_y = ay;
+
+	return world;
+}
+
+/** Hands the committed properties of an actor to the submission thread. */
+static void submit_commit(HAA_ActorPriv* actor)
+{
+	const Uint8 pending = actor_world_pending(actor);
+	HAA_Command *cmd;
+
+	if (!pending) return;
+
+	cmd = submit_new(HAA_CMD_COMMIT, actor);
+	if (!cmd) {
+		/* Keep them pending for the next commit. */
 		return;
 	}
+	HAA_Actor world;
+	cmd->u.props = *actor_world(actor, &world);
+	cmd->u.props.pending = pending;
+	actor->p.pending = HAA_PENDING_NOTHING;
+	submit_post(cmd);
+}
 
-	if (actor->ready) {
-		/* Ready flag already set, which means hildon-desktop just restarted.
-		  Reset this actor. */
-		XUnmapWindow(display, window);
-		XSync(display, False);
-		XMapWindow(display, window);
-		XSync(display, False);
-
-		/* Hildon-desktop restarting means all the system will be under
-		  extreme load. Relax. */
-		// TODO: Delay once per crash, not per actor.
-		SDL_Delay(500);
-
-		/* Next Flip will resend every setting */
-		actor->p.pending = HAA_PENDING_EVERYTHING;
+/** Call after changing the ready flag or parent of an actor.
+  * @param resend properties that must be sent again.
+  * @param forget whether the compositor forgot about every property.
+  */
+static void actor_state_changed(HAA_ActorPriv* actor, Uint8 resend,
+	Bool forget)
+{
+	if (submit_display) {
+		HAA_Command *cmd = submit_new(HAA_CMD_STATE, actor);
+		if (!cmd) return;
+		cmd->u.state.parent = actor->parent;
+		cmd->u.state.ready = actor->ready;
+		cmd->u.state.resend = resend;
+		cmd->u.state.forget = forget;
+		submit_post(cmd);
 		return;
 	}
 
-	actor->ready = 1;
+	actor->p.pending |= resend;
+	if (forget) {
+		actor->sent_valid = HAA_PENDING_NOTHING;
+	}
+}
 
-	/* Send all pending messages now */
-	HAA_Pending(actor);
+#ifdef HAVE_XCB
+/** Interns the atoms and queries XSHM with pipelined requests.
+  * Xlib takes three round trips for this (the batched XInternAtoms, then
+  * the XSHM extension and version queries), or two if SDL already looked
+  * XSHM up through it. Here the atoms travel along with the extension
+  * query, for two round trips in every case. */
+static void init_query(void)
+{
+	xcb_connection_t *c = XGetXCBConnection(display);
+	xcb_intern_atom_cookie_t cookies[ATOM_COUNT];
+	int i;
 
-	/* Force a redraw */
-	sdl_expose();
+#ifdef HAVE_XSHM
+	xcb_prefetch_extension_data(c, &xcb_shm_id);
+#endif
+	for (i = 0; i < ATOM_COUNT; i++) {
+		cookies[i] = xcb_intern_atom(c, True,
+			strlen(atom_names[i]), atom_names[i]);
+	}
+
+#ifdef HAVE_XSHM
+	/* Waits for the extension data, along with the atoms. */
+	const xcb_query_extension_reply_t *ext =
+		xcb_get_extension_data(c, &xcb_shm_id);
+	xcb_shm_query_version_cookie_t shm_cookie = { 0 };
+	have_shm = ext && ext->present;
+	if (have_shm) {
+		shm_cookie = xcb_shm_query_version(c);
+		shm_event_base = ext->first_event;
+	}
+#endif
+
+	for (i = 0; i < ATOM_COUNT; i++) {
+		xcb_intern_atom_reply_t *reply =
+			xcb_intern_atom_reply(c, cookies[i], NULL);
+		atom_values[i] = reply ? reply->atom : None;
+		free(reply);
+	}
+
+#ifdef HAVE_XSHM
+	if (have_shm) {
+		xcb_shm_query_version_reply_t *reply =
+			xcb_shm_query_version_reply(c, shm_cookie, NULL);
+		if (reply) {
+			shm_major = reply->major_version;
+			shm_minor = reply->minor_version;
+			shm_pixmaps = reply->shared_pixmaps;
+			free(reply);
+		} else {
+			have_shm = False;
+		}
+	}
+#endif
 }
+#endif
 
-int HAA_FilterEvent(const SDL_Event *event)
+int HAA_Init(Uint32 flags)
 {
-	handle_queued_reparent();
+	SDL_SysWMinfo info;
 
-	if (event->type == SDL_SYSWMEVENT) {
-		const XEvent *e = &event->syswm.msg->event.xevent;
-		if (e->type == PropertyNotify) {
-			if (e->xproperty.atom == ATOM(_HILDON_ANIMATION_CLIENT_READY)) {
-				HAA_ActorPriv* actor =
-					find_actor_for_window(e->xproperty.window);
-				if (actor) {
-					actor_update_ready(actor);
-					return 0; // Handled
-				}
-			}
+	SDL_VERSION(&info.version);
+	if (SDL_GetWMInfo(&info) != 1) {
+		SDL_SetError("SDL_haa is incompatible with this SDL version");
+		return -1;
+	}
+
+	display = info.info.x11.display;
+	parent_window = 0;
+	queued_reparent = False;
+	watched_fswindow = watched_wmwindow = 0;
+	restart_remap_time = 0;
+	restart_timer = NULL;
+	first = last = NULL;
+	timelines = NULL;
+	groups = NULL;
+	clocks = NULL;
+	in_frame = False;
+#ifndef HAA_NO_STATS
+	memset(&stats, 0, sizeof(stats));
+#endif
+	pool_first = NULL;
+	pool_count = pool_max_actors = 0;
+	pool_bytes = pool_max_bytes = 0;
+	actor_context = XUniqueContext();
+
+#ifdef HAVE_XCB
+	init_query();
+#else
+	XInternAtoms(display, (char**)atom_names, ATOM_COUNT, True, atom_values);
+#endif
+
+	async_errors = flags & HAA_INIT_ASYNC_ERRORS ? True : False;
+	if (async_errors || flags & HAA_INIT_THREADED) {
+		request_spans = NULL;
+		span_capacity = span_head = span_count = 0;
+		prev_error_handler = XSetErrorHandler(error_handler);
+	}
+
+#ifdef HAVE_XSHM
+#ifndef HAVE_XCB
+	have_shm = XShmQueryVersion(display, &shm_major, &shm_minor, &shm_pixmaps);
+	if (have_shm) {
+		shm_event_base = XShmGetEventBase(display);
+	}
+#endif
+	slabs = NULL;
+#endif
+
+	submit_display = NULL;
+	if (flags & HAA_INIT_THREADED) {
+		if (submit_start() != 0) {
+			/* SDL Error already set */
+			XSetErrorHandler(prev_error_handler);
+			return -1;
 		}
-	} else if (event->type == SDL_ACTIVEEVENT) {
-		/* We know that after an input focus loss, the fullscreen window
-		 * will be unampped. We get no warnings about when this happens.
-		 * So we take a preventive approach and automatically reparent to the
-		 * windowed window when any out of focus event happens.
-		 * Of course, we have then to reparent to the fullscreen window when
-		 * the focus comes back. But we have a problem: there's a 1.5 second
-		 * delay between getting focus and SDL actually mapping the fullscreen
-		 * window, and we cannot reparent back to the fullscreen window while
-		 * it is unmapped.
-		 */
-		if (event->active.state == SDL_APPINPUTFOCUS) {
-			SDL_Surface *screen = SDL_GetVideoSurface();
-			if (screen && screen->flags & SDL_FULLSCREEN) {
-				if (event->active.gain) {
-					/* Gaining fullscreen focus:
-					 * Wait for 1.5 seconds before reparenting to fullscreen.
-					 */
-					queue_auto_reparent_to(True, 1500);
-				} else {
-					/* Losing fullscreen focus:
-					 * Windowed mode window is always mapped; can reparent now.
-					 */
-					auto_reparent_all_to(False);
-				}
+	}
+
+	/* This might add some noise to your event queue, but we need them. */
+	SDL_EventState(SDL_SYSWMEVENT, SDL_ENABLE);
+
+	/* Lets unmodified programs be traced. */
+	trace_file = NULL;
+	const char *trace = getenv("SDL_HAA_TRACE");
+	if (trace && trace[0]) {
+		HAA_StartTrace(trace);
+	}
+
+	return 0;
+}
+
+void HAA_Quit()
+{
+	HAA_StopTrace();
+
+	if (restart_timer) {
+		SDL_RemoveTimer(restart_timer);
+		restart_timer = NULL;
+	}
+
+	/* Get rid of any pooled actor */
+	pool_max_actors = 0;
+	pool_trim();
+
+	if (async_errors || submit_display) {
+		submit_stop();
+		XSetErrorHandler(prev_error_handler);
+		async_errors = False;
+		free(request_spans);
+		request_spans = NULL;
+		span_capacity = span_head = span_count = 0;
+	}
+}
+
+static HAA_ActorPriv* find_actor_for_window(Window w)
+{
+	XPointer a;
+
+	if (XFindContext(display, w, actor_context, &a) != 0) {
+		return NULL;
+	}
+
+	return (HAA_ActorPriv*) a;
+}
+
+static void actor_send_message(HAA_ActorPriv* actor, Atom message_type,
+		Uint32 l0, Uint32 l1, Uint32 l2, Uint32 l3, Uint32 l4)
+{
+	Window window = actor->window;
+	XEvent event = { 0 };
+
+	event.xclient.type = ClientMessage;
+	event.xclient.window = window;
+	event.xclient.message_type = message_type;
+	event.xclient.format = 32;
+	event.xclient.data.l[0] = l0;
+	event.xclient.data.l[1] = l1;
+	event.xclient.data.l[2] = l2;
+	event.xclient.data.l[3] = l3;
+	event.xclient.data.l[4] = l4;
+
+	XSendEvent(out_display(), window, True,
+		StructureNotifyMask,
+		(XEvent *)&event);
+
+#ifdef HAA_NO_STATS
+	if (!trace_file) return;
+#endif
+
+	int i;
+	for (i = 0; i < HAA_MESSAGE_COUNT; i++) {
+		if (message_type == atom_values[ATOM_HILDON_ANIMATION_CLIENT_MESSAGE_SHOW + i]) {
+			break;
+		}
+	}
+	if (i == HAA_MESSAGE_COUNT) return;
+
+	STAT_ADD(actor, messages[i], 1);
+	if (trace_file) {
+		HAA_TraceMessage rec = { 0 };
+		rec.window = window;
+		rec.message = i;
+		rec.data[0] = l0;
+		rec.data[1] = l1;
+		rec.data[2] = l2;
+		rec.data[3] = l3;
+		rec.data[4] = l4;
+		trace_record(HAA_TRACE_MESSAGE, &rec, sizeof(rec));
+	}
+}
+
+/** Whether a window exists and is viewable. */
+static Bool window_viewable(Window w)
+{
+	XWindowAttributes attr;
+
+	if (!w) return False;
+	if (!XGetWindowAttributes(display, w, &attr)) return False;
+
+	return attr.map_state == IsViewable;
+}
+
+/** Moves all actors to a new parent by just telling the compositor;
+  * ready actors stay ready. */
+static void reparent_all_light(void)
+{
+	const Uint8 resend = HAA_PENDING_PARENT | HAA_PENDING_SHOW;
+	Uint32 now = SDL_GetTicks();
+	HAA_ActorPriv* a;
+
+	for (a = first; a; a = a->next) {
+		a->parent = parent_window;
+		if (a->ready) {
+			/* See actor_update_ready() */
+			a->reparent_time = now ? now : 1;
+		}
+		actor_state_changed(a, resend, False);
+		if (!submit_display && a->ready) {
+			HAA_Actor world;
+			/* Just these; other changes wait for the app to commit them. */
+			actor_send_pending(a, actor_world(a, &world), a->parent, resend);
+			a->p.pending &= ~resend;
+		}
+	}
+
+	XFlush(display);
+}
+
+static void reparent_all_to(Window new_parent)
+{
+	/* video mode has changed */
+	parent_window = new_parent;
+	STAT_GLOBAL_ADD(reparents, 1);
+
+	/* if we don't have any actors, no need to reparent them */
+	if (first == NULL) {
+		assert(last == NULL);
+		return;
+	}
+
+	/* The compositor moves actors over when asked to. Should it drop some
+	 * along with their old parent instead, actor_update_ready() remaps them. */
+	reparent_all_light();
+}
+
+/** Makes the compositor start over with an actor it dropped. */
+static void actor_remap(HAA_ActorPriv* actor)
+{
+	XUnmapWindow(display, actor->window);
+	trace_window(HAA_TRACE_UNMAP, actor->window);
+	XMapWindow(display, actor->window);
+	trace_window(HAA_TRACE_MAP, actor->window);
+	XFlush(display);
+}
+
+/** The SDL window actors should be children of. */
+static Window auto_parent(Bool fullscreen)
+{
+	SDL_SysWMinfo info;
+	int res;
+
+	SDL_VERSION(&info.version);
+	res = SDL_GetWMInfo(&info);
+	assert(res == 1);
+
+	if (fullscreen) {
+		return info.info.x11.fswindow;
+	} else {
+		return info.info.x11.wmwindow;
+	}
+}
+
+/** Reparents to new_parent, if needed and possible.
+  * @param is_mapped whether new_parent is viewable. */
+static int auto_reparent_to(Window new_parent, Bool is_mapped)
+{
+	/* Delete any pending reparent */
+	queued_reparent = False;
+
+	/* Do we really need to reparent? */
+	if (new_parent != parent_window) {
+		/* Yes, we do. */
+		if (is_mapped) {
+			reparent_all_to(new_parent);
+			return 0;
+		} else {
+			return 1;
+		}
+	} else if (!is_mapped) {
+		/* We don't actually need to reparent,
+		 * but we found that our current parent has been unmapped! */
+		parent_window = 0; // Make current one it invalid
+		return 1; // Signal failure
+	} else {
+		/* We don't need to reparent and everything is OK. */
+		return 0;
+	}
+}
+
+static int auto_reparent_all_to(Bool fullscreen)
+{
+	Window new_parent = auto_parent(fullscreen);
+
+	return auto_reparent_to(new_parent, window_viewable(new_parent));
+}
+
+static void queue_auto_reparent_to(Bool fullscreen)
+{
+	queued_reparent = True;
+	queued_reparent_fs = fullscreen;
+}
+
+/** Reparents now if possible, or once the new parent is mapped. */
+static void auto_reparent_or_queue(Bool fullscreen)
+{
+	if (auto_reparent_all_to(fullscreen) != 0) {
+		queue_auto_reparent_to(fullscreen);
+	}
+}
+
+/** Called when one of SDL's windows might have been mapped. */
+static void handle_queued_reparent()
+{
+	if (queued_reparent) {
+		auto_reparent_or_queue(queued_reparent_fs);
+	}
+}
+
+/** Asks for map notifications on one of SDL's windows, keeping the events
+  * SDL already asked for. */
+static void watch_window(Window w)
+{
+	XWindowAttributes attr;
+
+	if (!w) return;
+	if (!XGetWindowAttributes(display, w, &attr)) return;
+	if (attr.your_event_mask & StructureNotifyMask) return;
+
+	XSelectInput(display, w, attr.your_event_mask | StructureNotifyMask);
+}
+
+/** Calls watch_window() on SDL's windows, unless already done. */
+static void watch_sdl_windows(void)
+{
+	SDL_SysWMinfo info;
+
+	SDL_VERSION(&info.version);
+	if (SDL_GetWMInfo(&info) != 1) return;
+
+	if (info.info.x11.fswindow != watched_fswindow) {
+		watched_fswindow = info.info.x11.fswindow;
+		watch_window(watched_fswindow);
+	}
+	if (info.info.x11.wmwindow != watched_wmwindow) {
+		watched_wmwindow = info.info.x11.wmwindow;
+		watch_window(watched_wmwindow);
+	}
+}
+
+int HAA_SetVideoMode()
+{
+	SDL_Surface *screen = SDL_GetVideoSurface();
+
+	if (!screen) {
+		SDL_SetError("Failed to get current video surface");
+		return 1;
+	}
+
+	watch_sdl_windows();
+
+	/* SDL may not have mapped the window yet. */
+	auto_reparent_or_queue(screen->flags & SDL_FULLSCREEN ? True : False);
+
+	return 0;
+}
+
+/** Of the given pending bits, returns those whose values (in p and parent)
+  * the compositor does not already have. */
+static Uint8 actor_changed(HAA_ActorPriv* actor, const HAA_Actor *p,
+	Window parent, Uint8 pending)
+{
+	const HAA_Actor *sent = &actor->sent;
+	Uint8 same = 0;
+
+	if (p->gravity == sent->gravity &&
+			p->anchor_x == sent->anchor_x && p->anchor_y == sent->anchor_y)
+		same |= HAA_PENDING_ANCHOR;
+	if (p->position_x == sent->position_x &&
+			p->position_y == sent->position_y && p->depth == sent->depth)
+		same |= HAA_PENDING_POSITION;
+	if (p->x_rotation_angle == sent->x_rotation_angle &&
+			p->x_rotation_y == sent->x_rotation_y &&
+			p->x_rotation_z == sent->x_rotation_z)
+		same |= HAA_PENDING_ROTATION_X;
+	if (p->y_rotation_angle == sent->y_rotation_angle &&
+			p->y_rotation_x == sent->y_rotation_x &&
+			p->y_rotation_z == sent->y_rotation_z)
+		same |= HAA_PENDING_ROTATION_Y;
+	if (p->z_rotation_angle == sent->z_rotation_angle &&
+			p->z_rotation_x == sent->z_rotation_x &&
+			p->z_rotation_y == sent->z_rotation_y)
+		same |= HAA_PENDING_ROTATION_Z;
+	if (p->scale_x == sent->scale_x && p->scale_y == sent->scale_y)
+		same |= HAA_PENDING_SCALE;
+	if (parent == actor->sent_parent)
+		same |= HAA_PENDING_PARENT;
+	if (p->visible == sent->visible && p->opacity == sent->opacity)
+		same |= HAA_PENDING_SHOW;
+
+	return pending & ~(same & actor->sent_valid);
+}
+
+/** Remembers the given values of the given properties as sent. */
+static void actor_sent(HAA_ActorPriv* actor, const HAA_Actor *p,
+	Window parent, Uint8 pending)
+{
+	HAA_Actor *sent = &actor->sent;
+
+	if (pending & HAA_PENDING_ANCHOR) {
+		sent->gravity = p->gravity;
+		sent->anchor_x = p->anchor_x;
+		sent->anchor_y = p->anchor_y;
+	}
+	if (pending & HAA_PENDING_POSITION) {
+		sent->position_x = p->position_x;
+		sent->position_y = p->position_y;
+		sent->depth = p->depth;
+	}
+	if (pending & HAA_PENDING_ROTATION_X) {
+		sent->x_rotation_angle = p->x_rotation_angle;
+		sent->x_rotation_y = p->x_rotation_y;
+		sent->x_rotation_z = p->x_rotation_z;
+	}
+	if (pending & HAA_PENDING_ROTATION_Y) {
+		sent->y_rotation_angle = p->y_rotation_angle;
+		sent->y_rotation_x = p->y_rotation_x;
+		sent->y_rotation_z = p->y_rotation_z;
+	}
+	if (pending & HAA_PENDING_ROTATION_Z) {
+		sent->z_rotation_angle = p->z_rotation_angle;
+		sent->z_rotation_x = p->z_rotation_x;
+		sent->z_rotation_y = p->z_rotation_y;
+	}
+	if (pending & HAA_PENDING_SCALE) {
+		sent->scale_x = p->scale_x;
+		sent->scale_y = p->scale_y;
+	}
+	if (pending & HAA_PENDING_PARENT) {
+		actor->sent_parent = parent;
+	}
+	if (pending & HAA_PENDING_SHOW) {
+		sent->visible = p->visible;
+		sent->opacity = p->opacity;
+	}
+
+	actor->sent_valid |= pending;
+}
+
+/** Sends the given properties, if the compositor does not have them yet. */
+static void actor_send_pending(HAA_ActorPriv* actor, const HAA_Actor *p,
+	Window parent, Uint8 pending)
+{
+	pending = actor_changed(actor, p, parent, pending);
+
+	if (pending & HAA_PENDING_ANCHOR) {
+		 actor_send_message(actor,
+		 	ATOM(_HILDON_ANIMATION_CLIENT_MESSAGE_ANCHOR),
+			p->gravity, p->anchor_x, p->anchor_y, 0, 0);
+	}
+	if (pending & HAA_PENDING_POSITION) {
+		 actor_send_message(actor,
+		 	ATOM(_HILDON_ANIMATION_CLIENT_MESSAGE_POSITION),
+			p->position_x, p->position_y, p->depth, 0, 0);
+	}
+
+	if (pending & HAA_PENDING_ROTATION_X) {
+		 actor_send_message(actor,
+		 	ATOM(_HILDON_ANIMATION_CLIENT_MESSAGE_ROTATION),
+			HAA_X_AXIS,
+			p->x_rotation_angle,
+			0, p->x_rotation_y, p->x_rotation_z);
+	}
+	if (pending & HAA_PENDING_ROTATION_Y) {
+		 actor_send_message(actor,
+		 	ATOM(_HILDON_ANIMATION_CLIENT_MESSAGE_ROTATION),
+			HAA_Y_AXIS,
+			p->y_rotation_angle,
+			p->y_rotation_x, 0, p->y_rotation_z);
+	}
+	if (pending & HAA_PENDING_ROTATION_Z) {
+		 actor_send_message(actor,
+		 	ATOM(_HILDON_ANIMATION_CLIENT_MESSAGE_ROTATION),
+			HAA_Z_AXIS,
+			p->z_rotation_angle,
+			p->z_rotation_x, p->z_rotation_y, 0);
+	}
+
+	if (pending & HAA_PENDING_SCALE) {
+		 actor_send_message(actor,
+		 	ATOM(_HILDON_ANIMATION_CLIENT_MESSAGE_SCALE),
+			p->scale_x, p->scale_y, 0, 0, 0);
+	}
+
+	if (pending & HAA_PENDING_PARENT) {
+		 actor_send_message(actor,
+			ATOM(_HILDON_ANIMATION_CLIENT_MESSAGE_PARENT),
+			parent, 0, 0, 0, 0);
+	}
+	if (pending & HAA_PENDING_SHOW) {
+		 actor_send_message(actor,
+		 	ATOM(_HILDON_ANIMATION_CLIENT_MESSAGE_SHOW),
+			p->visible, p->opacity, 0, 0, 0);
+	}
+
+	actor_sent(actor, p, parent, pending);
+}
+
+static void HAA_Pending(HAA_ActorPriv* actor)
+{
+	if (submit_display) {
+		/* The submission thread knows whether the actor is ready. */
+		submit_commit(actor);
+		return;
+	}
+
+	if (!actor->ready) return; //Enqueue and wait
+
+	HAA_Actor world;
+	actor_send_pending(actor, actor_world(actor, &world), actor->parent,
+		actor_world_pending(actor));
+
+	actor->p.pending = HAA_PENDING_NOTHING;
+}
+
+/** Push a SDL_VIDEOEXPOSE event to the queue */
+static void sdl_expose()
+{
+	SDL_Event events[32];
+
+	/* Pull out all old refresh events */
+	SDL_PeepEvents(events, sizeof(events)/sizeof(events[0]),
+		SDL_GETEVENT, SDL_VIDEOEXPOSEMASK);
+
+	/* Post the event, if desired */
+	if ( SDL_EventState(SDL_VIDEOEXPOSE, SDL_QUERY) == SDL_ENABLE ) {
+		SDL_Event event;
+		event.type = SDL_VIDEOEXPOSE;
+		SDL_PushEvent(&event);
+	}
+}
+
+/** Timer callback: pushes an event so that HAA_FilterEvent gets called
+  * even if the app is sleeping in SDL_WaitEvent. */
+static Uint32 restart_wakeup(Uint32 interval, void *param)
+{
+	SDL_Event event;
+
+	(void) param;
+
+	event.type = SDL_USEREVENT;
+	event.user.code = 0;
+	event.user.data1 = &restart_timer;
+	event.user.data2 = NULL;
+	SDL_PushEvent(&event);
+
+	return interval;
+}
+
+/** Reacts to a compositor restart: unmaps every actor at once, and leaves
+  * mapping them again to restart_handle(), after a while. */
+static void restart_begin(void)
+{
+	HAA_ActorPriv* a;
+
+	STAT_GLOBAL_ADD(compositor_restarts, 1);
+
+	lock_actors();
+	for (a = first; a; a = a->next) {
+		a->restarting = True;
+		a->ready = 0;
+		/* The new compositor will set it again after we remap. */
+		XDeleteProperty(display, a->window,
+			ATOM(_HILDON_ANIMATION_CLIENT_READY));
+		XUnmapWindow(display, a->window);
+		trace_window(HAA_TRACE_UNMAP, a->window);
+		/* The new compositor knows nothing; send everything once ready. */
+		actor_state_changed(a, HAA_PENDING_EVERYTHING, True);
+	}
+	unlock_actors();
+	XFlush(display);
+
+	/* Hildon-desktop restarting means all the system will be under
+	 * extreme load. Relax, but without blocking the app. */
+	restart_remap_time = SDL_GetTicks() + RESTART_BACKOFF;
+	if (!restart_remap_time) restart_remap_time = 1;
+
+	/* Without the timer subsystem, wait for the next event instead. */
+	if (!restart_timer) {
+		restart_timer = SDL_AddTimer(RESTART_BACKOFF, restart_wakeup, NULL);
+	}
+}
+
+/** Maps again the actors unmapped by restart_begin(), if it is time. */
+static void restart_handle(void)
+{
+	HAA_ActorPriv* a;
+
+	if (!restart_remap_time) return;
+	if ((Sint32) (SDL_GetTicks() - restart_remap_time) < 0) return;
+
+	restart_remap_time = 0;
+	if (restart_timer) {
+		SDL_RemoveTimer(restart_timer);
+		restart_timer = NULL;
+	}
+
+	lock_actors();
+	for (a = first; a; a = a->next) {
+		if (!a->restarting) continue;
+		a->restarting = False;
+		XMapWindow(display, a->window);
+		trace_window(HAA_TRACE_MAP, a->window);
+	}
+	unlock_actors();
+	XFlush(display);
+}
+
+/** Called when the client ready notification is received. */
+static void actor_update_ready(HAA_ActorPriv* actor)
+{
+	Window window = actor->window;
+	int status;
+	Atom actual_type;
+	int actual_format;
+	unsigned long nitems, bytes_after;
+	unsigned char *prop = NULL;
+
+	status = XGetWindowProperty(display, window,
+		ATOM(_HILDON_ANIMATION_CLIENT_READY), 0, 32,
+		False, XA_ATOM,
+		&actual_type, &actual_format,
+		&nitems, &bytes_after, &prop);
+
+	if (prop) {
+		XFree(prop);
+	}
+
+	if (status != Success || actual_type != XA_ATOM ||
+			actual_format != 32 || nitems != 1)  {
+		if (actor->ready) {
+			Bool dropped = actor->reparent_time && !actor->restarting &&
+				SDL_GetTicks() - actor->reparent_time < REPARENT_TIMEOUT;
+			actor->ready = 0;
+			actor->reparent_time = 0;
+			if (dropped) {
+				/* The compositor forgot the actor when we reparented it. */
+				actor_remap(actor);
+				actor_state_changed(actor, HAA_PENDING_EVERYTHING, True);
+			} else {
+				actor_state_changed(actor, HAA_PENDING_NOTHING, False);
+			}
+		}
+		return;
+	}
+
+	if (actor->restarting) {
+		/* Left over from before the restart; it will be set again
+		 * once we map the actor again. */
+		return;
+	}
+
+	if (actor->ready) {
+		/* Ready flag already set, which means hildon-desktop just restarted. */
+		restart_begin();
+		return;
+	}
+
+	actor->ready = 1;
+
+	/* The compositor knows nothing about this actor yet. */
+	actor_state_changed(actor, HAA_PENDING_NOTHING, True);
+
+	/* Send all pending messages now; the submission thread does it itself. */
+	if (!submit_display) {
+		HAA_Pending(actor);
+	}
+
+	/* Force a redraw */
+	sdl_expose();
+}
+
+#ifdef HAVE_XSHM
+/** Called when the X server is done reading from one of our buffers. */
+static void actor_shm_completion(HAA_ActorPriv* actor,
+	const XShmCompletionEvent *e)
+{
+	int i;
+
+	for (i = 0; i < actor->num_buffers; i++) {
+		HAA_Buffer *buf = &actor->buffers[i];
+		const XShmSegmentInfo *shminfo =
+			(const XShmSegmentInfo *) buf->image->obdata;
+		/* Ignore completions for older requests on the same buffer. */
+		if (shminfo->shmseg == e->shmseg &&
+				buf->offset == e->offset &&
+				(long)(e->serial - buf->serial) >= 0) {
+			buf->busy = False;
+		}
+	}
+}
+#endif
+
+int HAA_FilterEvent(const SDL_Event *event)
+{
+	restart_handle();
+
+	if (event->type == SDL_USEREVENT &&
+			event->user.data1 == &restart_timer) {
+		return 0; // Our own wake-up call
+	} else if (event->type == SDL_SYSWMEVENT) {
+		const XEvent *e = &event->syswm.msg->event.xevent;
+		if (e->type == MapNotify) {
+			handle_queued_reparent();
+		} else if (e->type == PropertyNotify) {
+			if (frame_fence_returned(e->xproperty.window)) {
+				return 0; // Handled
+			}
+			if (e->xproperty.atom == ATOM(_HILDON_ANIMATION_CLIENT_READY)) {
+				HAA_ActorPriv* actor =
+					find_actor_for_window(e->xproperty.window);
+				if (actor) {
+					actor_update_ready(actor);
+					return 0; // Handled
+				}
+			}
+		}
+#ifdef HAVE_XSHM
+		else if (have_shm && e->type == shm_event_base + ShmCompletion) {
+			const XShmCompletionEvent *ce = (const XShmCompletionEvent *) e;
+			HAA_ActorPriv* actor = find_actor_for_window(ce->drawable);
+			if (actor) {
+				actor_shm_completion(actor, ce);
+				return 0; // Handled
+			}
+		}
+#endif
+	} else if (event->type == SDL_ACTIVEEVENT) {
+		/* We know that after an input focus loss, the fullscreen window
+		 * will be unampped. We get no warnings about when this happens.
+		 * So we take a preventive approach and automatically reparent to the
+		 * windowed window when any out of focus event happens.
+		 * Of course, we have then to reparent to the fullscreen window when
+		 * the focus comes back. But SDL maps the fullscreen window a while
+		 * after getting focus, and we cannot reparent back to it while
+		 * it is unmapped; so we wait for it to be mapped. SDL turns the
+		 * MapNotify into an SDL_APPACTIVE gain (or, if it lets us see it,
+		 * a MapNotify SDL_SYSWMEVENT).
+		 */
+		if (event->active.gain && (event->active.state & SDL_APPACTIVE)) {
+			handle_queued_reparent();
+		}
+		if (event->active.state == SDL_APPINPUTFOCUS) {
+			SDL_Surface *screen = SDL_GetVideoSurface();
+			if (screen && screen->flags & SDL_FULLSCREEN) {
+				if (event->active.gain) {
+					/* Gaining fullscreen focus:
+					 * Reparent to fullscreen as soon as it is mapped.
+					 */
+					auto_reparent_or_queue(True);
+				} else {
+					/* Losing fullscreen focus:
+					 * Windowed mode window is always mapped; can reparent now.
+					 */
+					auto_reparent_all_to(False);
+				}
+			}
+		}
+	} else if (event->type == SDL_VIDEOEXPOSE) {
+		/* Mapping the window exposes it, too. */
+		handle_queued_reparent();
+	}
+
+	return 1; // Unhandled event
+}
+
+#ifdef HAVE_XSHM
+/** Creates and attaches a new shared memory slab. */
+static HAA_ShmSlab* slab_create(size_t size, Bool writable)
+{
+	HAA_ShmSlab *slab = malloc(sizeof(HAA_ShmSlab));
+	HAA_ShmBlock *block = malloc(sizeof(HAA_ShmBlock));
+	if (!slab || !block) {
+		SDL_Error(SDL_ENOMEM);
+		free(slab);
+		free(block);
+		return NULL;
+	}
+
+	slab->shminfo.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT|0777);
+	if (slab->shminfo.shmid < 0) {
+		SDL_SetError("Failed to get shared memory");
+		goto cleanup_slab;
+	}
+
+	slab->shminfo.shmaddr = shmat(slab->shminfo.shmid, NULL, 0);
+	if (slab->shminfo.shmaddr == (char *) -1) {
+		SDL_SetError("Failed to attach shared memory");
+		shmctl(slab->shminfo.shmid, IPC_RMID, 0);
+		goto cleanup_slab;
+	}
+
+	slab->shminfo.readOnly = !writable;
+	if (!XShmAttach(display, &slab->shminfo)) {
+		SDL_SetError("Failed to attach shared memory image");
+		shmdt(slab->shminfo.shmaddr);
+		shmctl(slab->shminfo.shmid, IPC_RMID, 0);
+		goto cleanup_slab;
+	}
+
+	/* Ensure attachment is done */
+	wait_for_server();
+
+	if (submit_display) {
+		/* The submission thread does the puts, on its own connection. */
+		HAA_Command cmd;
+		cmd.type = HAA_CMD_SHM_ATTACH;
+		cmd.actor = NULL;
+		cmd.u.slab = slab;
+		slab->submit_shminfo = slab->shminfo;
+		submit_call(&cmd);
+	}
+
+	/* Nobody else needs it now */
+	shmctl(slab->shminfo.shmid, IPC_RMID, 0);
+
+	block->offset = 0;
+	block->size = size;
+	block->next = NULL;
+
+	slab->size = size;
+	slab->writable = writable;
+	STAT_GLOBAL_ADD(shm_bytes, size);
+	slab->free = block;
+	slab->used = 0;
+	slab->next = slabs;
+	slabs = slab;
+
+	return slab;
+
+cleanup_slab:
+	free(block);
+	free(slab);
+	return NULL;
+}
+
+static void slab_destroy(HAA_ShmSlab *slab)
+{
+	HAA_ShmSlab **s;
+
+	for (s = &slabs; *s != slab; s = &(*s)->next);
+	*s = slab->next;
+
+	if (submit_display) {
+		HAA_Command cmd;
+		cmd.type = HAA_CMD_SHM_DETACH;
+		cmd.actor = NULL;
+		cmd.u.slab = slab;
+		submit_call(&cmd);
+	}
+	XShmDetach(display, &slab->shminfo);
+	STAT_GLOBAL_ADD(shm_bytes, -slab->size);
+	shmdt(slab->shminfo.shmaddr);
+
+	while (slab->free) {
+		HAA_ShmBlock *block = slab->free;
+		slab->free = block->next;
+		free(block);
+	}
+	free(slab);
+}
+
+/** Carves size bytes out of some slab, creating a new one if required. */
+static int shm_alloc(size_t size, Bool writable,
+	HAA_ShmSlab **slabp, size_t *offsetp)
+{
+	HAA_ShmSlab *slab;
+	HAA_ShmBlock *block, **prev;
+
+	size = (size + SHM_ALIGN - 1) & ~(size_t)(SHM_ALIGN - 1);
+
+	for (slab = slabs; slab; slab = slab->next) {
+		if (slab->writable != writable) continue;
+		for (prev = &slab->free, block = slab->free; block;
+				prev = &block->next, block = block->next) {
+			if (block->size >= size) goto found;
+		}
+	}
+
+	slab = slab_create(size > SHM_SLAB_SIZE ? size : SHM_SLAB_SIZE, writable);
+	if (!slab) {
+		/* SDL Error already set */
+		return -1;
+	}
+	prev = &slab->free;
+	block = slab->free;
+
+found:
+	*slabp = slab;
+	*offsetp = block->offset;
+	slab->used++;
+
+	if (block->size == size) {
+		*prev = block->next;
+		free(block);
+	} else {
+		block->offset += size;
+		block->size -= size;
+	}
+
+	return 0;
+}
+
+/** Returns a block to its slab; destroys the slab if it has become unused. */
+static void shm_free(HAA_ShmSlab *slab, size_t offset, size_t size)
+{
+	HAA_ShmBlock *block, *before, *after;
+
+	size = (size + SHM_ALIGN - 1) & ~(size_t)(SHM_ALIGN - 1);
+
+	slab->used--;
+	if (slab->used == 0) {
+		HAA_ShmSlab *s;
+		/* Keep a single empty default sized slab around, for the next actor. */
+		for (s = slabs; s; s = s->next) {
+			if (s != slab && s->used == 0) break;
+		}
+		if (s || slab->size != SHM_SLAB_SIZE) {
+			slab_destroy(slab);
+			return;
+		}
+	}
+
+	before = NULL;
+	after = slab->free;
+	while (after && after->offset < offset) {
+		before = after;
+		after = after->next;
+	}
+
+	/* Merge with the previous free block, if adjacent. */
+	if (before && before->offset + before->size == offset) {
+		before->size += size;
+		if (after && before->offset + before->size == after->offset) {
+			before->size += after->size;
+			before->next = after->next;
+			free(after);
+		}
+		return;
+	}
+
+	/* Merge with the next free block, if adjacent. */
+	if (after && offset + size == after->offset) {
+		after->offset = offset;
+		after->size += size;
+		return;
+	}
+
+	block = malloc(sizeof(HAA_ShmBlock));
+	if (!block) {
+		/* Just leak this range until the slab is destroyed. */
+		return;
+	}
+	block->offset = offset;
+	block->size = size;
+	block->next = after;
+	if (before) {
+		before->next = block;
+	} else {
+		slab->free = block;
+	}
+}
+#endif
+
+#ifdef HAVE_XSHM
+/** Pads rows to a cache line, if it can be done with whole pixels. */
+static void image_pad_rows(XImage *image, int width)
+{
+	if ((SHM_ALIGN * 8) % image->bits_per_pixel == 0) {
+		int align = SHM_ALIGN * 8 / image->bits_per_pixel;
+		image->width = (width + align - 1) / align * align;
+		image->bytes_per_line = image->width * image->bits_per_pixel / 8;
+	}
+}
+#endif
+
+/** Allocates the XImage (and shared memory) backing a buffer.
+  * @param writable whether a shared memory pixmap will use its memory. */
+static int buffer_create(HAA_Buffer *buf, XVisualInfo *vinfo,
+	int width, int height, Bool writable)
+{
+	XImage *image;
+
+#ifdef HAVE_XSHM
+	if (have_shm) {
+		image = buf->image = XShmCreateImage(display, vinfo->visual,
+			vinfo->depth, ZPixmap, NULL, NULL, width, height);
+		if (!image) {
+			SDL_SetError("Cannot create XSHM image");
+			return -1;
+		}
+
+		image_pad_rows(image, width);
+
+		buf->size = image->bytes_per_line * image->height;
+		if (shm_alloc(buf->size, writable, &buf->slab, &buf->offset) != 0) {
+			/* SDL Error already set */
+			XDestroyImage(image);
+			return -1;
+		}
+
+		/* XShmPutImage sends the offset of data into the segment. */
+		image->obdata = (char*) (submit_display ?
+			&buf->slab->submit_shminfo : &buf->slab->shminfo);
+		image->data = buf->slab->shminfo.shmaddr + buf->offset;
+		buf->pixmap = None;
+		buf->serial = 0;
+		buf->busy = False;
+		return 0;
+	}
+#endif
+
+	(void) writable;
+	buf->size = width * height * (vinfo->depth / 8);
+	void *pixels = malloc(buf->size);
+	if (!pixels) {
+		SDL_SetError("Cannot allocate image");
+		return -1;
+	}
+	image = buf->image = XCreateImage(display, vinfo->visual,
+		vinfo->depth, ZPixmap, 0, (char*) pixels, width, height, 8, 0);
+	if (!image) {
+		SDL_SetError("Cannot create X image");
+		free(pixels);
+		return -1;
+	}
+	buf->busy = False;
+
+	return 0;
+}
+
+static void buffer_free(HAA_Buffer *buf)
+{
+#ifdef HAVE_XSHM
+	if (have_shm) {
+		if (buf->pixmap) XFreePixmap(display, buf->pixmap);
+		XDestroyImage(buf->image);
+		shm_free(buf->slab, buf->offset, buf->size);
+		return;
+	}
+#endif
+	XDestroyImage(buf->image);
+}
+
+#ifdef HAVE_XSHM
+static Bool pixmap_failed;
+static int (*pixmap_prev_handler)(Display *, XErrorEvent *);
+
+static int pixmap_error_handler(Display *d, XErrorEvent *e)
+{
+	if (d != display) {
+		/* The submission thread connection. */
+		return pixmap_prev_handler ? pixmap_prev_handler(d, e) : 0;
+	}
+	pixmap_failed = True;
+	return 0;
+}
+
+/** Creates a shared memory pixmap over the image of a buffer,
+  * waiting for the server to see whether it worked.
+  * @return 0, or -1 (leaving buf->pixmap as None) on failure. */
+static int buffer_create_pixmap(HAA_Buffer *buf, Window window)
+{
+	XImage *image = buf->image;
+
+	/* Errors of earlier requests go to whoever expects them. */
+	XSync(display, False);
+
+	pixmap_failed = False;
+	pixmap_prev_handler = XSetErrorHandler(pixmap_error_handler);
+	buf->pixmap = XShmCreatePixmap(display, window, image->data,
+		&buf->slab->shminfo, image->width, image->height, image->depth);
+	wait_for_server();
+	XSetErrorHandler(pixmap_prev_handler);
+
+	if (!buf->pixmap || pixmap_failed) {
+		buf->pixmap = None;
+		SDL_SetError("Cannot create XSHM pixmap");
+		return -1;
+	}
+
+	return 0;
+}
+#endif
+
+/** Prepares in next a new image of a different size for a buffer, over
+  * the memory of the buffer if it is big enough. The buffer itself is left
+  * alone until buffer_resize_commit(); buffer_resize_abort() drops next.
+  * @return 0, or -1 on failure. */
+static int buffer_resize_prepare(const HAA_Buffer *buf, HAA_Buffer *next,
+	Visual *visual, int width, int height)
+{
+	XImage *old = buf->image, *image;
+	size_t size;
+
+	*next = *buf;
+
+#ifdef HAVE_XSHM
+	if (have_shm) {
+		image = XShmCreateImage(display, visual,
+			old->depth, ZPixmap, NULL, NULL, width, height);
+	} else
+#endif
+	image = XCreateImage(display, visual, old->depth, ZPixmap, 0, NULL,
+		width, height, 8, 0);
+	if (!image) {
+		SDL_SetError("Cannot create X image");
+		return -1;
+	}
+#ifdef HAVE_XSHM
+	if (have_shm) image_pad_rows(image, width);
+#endif
+
+	image->data = old->data;
+	size = image->bytes_per_line * image->height;
+	if (size > buf->size) {
+		/* Leave room to grow by half again, so that an actor growing
+		 * bit by bit does not need new memory every time. */
+		size_t capacity = size + size / 2;
+#ifdef HAVE_XSHM
+		if (have_shm) {
+			if (shm_alloc(capacity, buf->slab->writable,
+					&next->slab, &next->offset) != 0) {
+				/* SDL Error already set */
+				XDestroyImage(image);
+				return -1;
+			}
+			image->data = next->slab->shminfo.shmaddr + next->offset;
+		} else
+#endif
+		{
+			char *data = malloc(capacity);
+			if (!data) {
+				SDL_Error(SDL_ENOMEM);
+				image->data = NULL;
+				XDestroyImage(image);
+				return -1;
+			}
+			image->data = data;
+		}
+		next->size = capacity;
+	}
+
+#ifdef HAVE_XSHM
+	if (have_shm) {
+		image->obdata = (char*) (submit_display ?
+			&next->slab->submit_shminfo : &next->slab->shminfo);
+		next->pixmap = None;
+		next->serial = 0;
+	}
+#endif
+	next->image = image;
+	next->busy = False;
+
+	return 0;
+}
+
+/** Frees what buffer_resize_prepare() allocated, leaving buf as it was. */
+static void buffer_resize_abort(const HAA_Buffer *buf, HAA_Buffer *next)
+{
+	if (next->image->data != buf->image->data) {
+		buffer_free(next);
+		return;
+	}
+
+#ifdef HAVE_XSHM
+	if (have_shm) {
+		if (next->pixmap) XFreePixmap(display, next->pixmap);
+	} else
+#endif
+	/* Still the buffer's. */
+	next->image->data = NULL;
+	XDestroyImage(next->image);
+}
+
+/** Replaces buf by the one prepared in next; contents are lost.
+  * The buffer must not be busy. */
+static void buffer_resize_commit(HAA_Buffer *buf, HAA_Buffer *next)
+{
+	XImage *image = next->image;
+
+	if (image->data != buf->image->data) {
+		buffer_free(buf);
+	} else {
+#ifdef HAVE_XSHM
+		if (have_shm) {
+			if (buf->pixmap) XFreePixmap(display, buf->pixmap);
+		} else
+#endif
+		/* Still ours. */
+		buf->image->data = NULL;
+		XDestroyImage(buf->image);
+	}
+
+	*buf = *next;
+	memset(image->data, 0, image->bytes_per_line * image->height);
+}
+
+/** Waits until the X server is done reading from the given buffer. */
+static void buffer_wait(HAA_Buffer *buf)
+{
+	if (submit_display) {
+		/* The submission thread will tell us. */
+		SDL_mutexP(submit_lock);
+		while (buf->busy) {
+			SDL_CondWait(submit_cond, submit_lock);
+		}
+		SDL_mutexV(submit_lock);
+		return;
+	}
+
+	if (buf->busy) {
+		/* The completion event might already be sitting in SDL's queue,
+		 * so don't wait for it; once XSync returns the server is done
+		 * with every request we sent, including this buffer's put. */
+		wait_for_server();
+		buf->busy = False;
+	}
+}
+
+static void actor_free_frames(HAA_ActorPriv* actor)
+{
+	if (actor->frames) {
+		XFreePixmap(display, actor->frames);
+		actor->frames = None;
+	}
+	actor->num_frames = 0;
+}
+
+/** Resets all actor properties to their defaults. */
+static void actor_set_defaults(HAA_ActorPriv* actor)
+{
+	memset(&actor->error, 0, sizeof(actor->error));
+	actor->numdamage = 0;
+	actor->restarting = False;
+	actor->reparent_time = 0;
+	actor->group = NULL;
+#ifndef HAA_NO_STATS
+	memset(&actor->stats, 0, sizeof(actor->stats));
+#endif
+	actor->p.position_x = 0;
+	actor->p.position_y = 0;
+	actor->p.depth = 0;
+	actor->p.visible = 0;
+	actor->p.opacity = 255;
+	actor->parent = parent_window;
+	actor->p.scale_x = 1 << 16;
+	actor->p.scale_y = 1 << 16;
+	actor->p.gravity = HAA_GRAVITY_NONE;
+	actor->p.anchor_x = 0;
+	actor->p.anchor_y = 0;
+	actor->p.x_rotation_angle = 0;
+	actor->p.x_rotation_y = 0;
+	actor->p.x_rotation_z = 0;
+	actor->p.y_rotation_angle = 0;
+	actor->p.y_rotation_x = 0;
+	actor->p.y_rotation_z = 0;
+	actor->p.z_rotation_angle = 0;
+	actor->p.z_rotation_x = 0;
+	actor->p.z_rotation_y = 0;
+	actor->p.pending =
+		HAA_PENDING_POSITION | HAA_PENDING_SCALE | HAA_PENDING_PARENT;
+	actor->ready = 0;
+	actor->sent_valid = HAA_PENDING_NOTHING;
+
+	/* Not yet known to the submission thread, so safe to set from here. */
+	actor->submit_props = actor->p;
+	actor->submit_pending = actor->p.pending;
+	actor->submit_ready = 0;
+	actor->submit_parent = actor->parent;
+}
+
+/** Creates the surface of a new actor: over its image if the formats match,
+  * or over pixels of its own, converted to the image format on every flip. */
+static int actor_create_surface(HAA_ActorPriv* actor, XImage *image,
+	const XVisualInfo *vinfo, Uint32 Amask)
+{
+	const Bool image_8888 = image->bits_per_pixel == 32 &&
+		vinfo->red_mask == 0xFF0000 && vinfo->green_mask == 0x00FF00 &&
+		vinfo->blue_mask == 0x0000FF;
+	const Bool image_565 = image->bits_per_pixel == 16 &&
+		vinfo->red_mask == 0xF800 && vinfo->green_mask == 0x07E0 &&
+		vinfo->blue_mask == 0x001F;
+	Uint32 flags = actor->flags;
+	int depth = image->depth;
+	Uint32 Rmask = vinfo->red_mask, Gmask = vinfo->green_mask,
+		Bmask = vinfo->blue_mask;
+	HAA_Convert convert = HAA_CONVERT_NONE;
+
+	if (flags & HAA_ACTOR_FORMAT_ARGB8888) {
+		depth = 32;
+		Rmask = 0x00FF0000; Gmask = 0x0000FF00; Bmask = 0x000000FF;
+		Amask = 0xFF000000;
+		if (image_8888) {
+			if ((flags & HAA_ACTOR_PREMULTIPLY) && image->depth == 32)
+				convert = HAA_CONVERT_PREMULTIPLY;
+		} else if (image_565) {
+			convert = flags & HAA_ACTOR_DITHER ?
+				HAA_CONVERT_8888_565_DITHER : HAA_CONVERT_8888_565;
+		} else {
+			convert = HAA_CONVERT_BLIT;
+		}
+	} else if (flags & HAA_ACTOR_FORMAT_RGB565) {
+		depth = 16;
+		Rmask = 0xF800; Gmask = 0x07E0; Bmask = 0x001F;
+		Amask = 0;
+		if (image_8888) {
+			convert = HAA_CONVERT_565_8888;
+		} else if (!image_565) {
+			convert = HAA_CONVERT_BLIT;
+		}
+	} else if ((flags & HAA_ACTOR_PREMULTIPLY) && image_8888 &&
+			image->depth == 32) {
+		convert = HAA_CONVERT_PREMULTIPLY;
+	}
+
+	actor->convert = convert;
+	actor->pixels = NULL;
+	actor->image_surface = NULL;
+	actor->prev_numrects = 0;
+
+	if (convert == HAA_CONVERT_NONE) {
+		actor->p.surface = SDL_CreateRGBSurfaceFrom(image->data,
+			actor->width, actor->height, depth, image->bytes_per_line,
+			Rmask, Gmask, Bmask, Amask);
+		return actor->p.surface ? 0 : -1;
+	}
+
+	/* Rows padded for the vector loads. */
+	int pitch = (actor->width * depth / 8 + 15) & ~15;
+	actor->pixels = calloc(actor->height, pitch);
+	if (!actor->pixels) {
+		SDL_Error(SDL_ENOMEM);
+		return -1;
+	}
+	actor->p.surface = SDL_CreateRGBSurfaceFrom(actor->pixels,
+		actor->width, actor->height, depth, pitch,
+		Rmask, Gmask, Bmask, Amask);
+	if (!actor->p.surface) goto cleanup_pixels;
+
+	if (convert == HAA_CONVERT_BLIT) {
+		actor->image_surface = SDL_CreateRGBSurfaceFrom(image->data,
+			actor->width, actor->height, image->bits_per_pixel,
+			image->bytes_per_line, vinfo->red_mask, vinfo->green_mask,
+			vinfo->blue_mask, image->depth == 32 ?
+				~(vinfo->red_mask | vinfo->green_mask | vinfo->blue_mask) : 0);
+		if (!actor->image_surface) goto cleanup_surface;
+		/* Copy the alpha channel instead of blending with it. */
+		SDL_SetAlpha(actor->p.surface, 0, SDL_ALPHA_OPAQUE);
+	}
+
+	return 0;
+
+cleanup_surface:
+	SDL_FreeSurface(actor->p.surface);
+cleanup_pixels:
+	free(actor->pixels);
+	actor->pixels = NULL;
+	return -1;
+}
+
+/** Creates the window, images and surface of a new actor,
+  * without mapping it or adding it to the actor list. */
+static HAA_ActorPriv* actor_new(Uint32 flags,
+	int width, int height, int bitsPerPixel)
+{
+	HAA_ActorPriv *actor = malloc(sizeof(HAA_ActorPriv));
+	if (!actor) {
+		SDL_Error(SDL_ENOMEM);
+		return NULL;
+	}
+
+	actor->flags = flags;
+	actor->width = width;
+	actor->height = height;
+	actor->bpp = bitsPerPixel;
+	actor->frames = None;
+	actor->num_frames = 0;
+	actor->shadow = NULL;
+	actor->shadow_valid = False;
+
+	/* Select the X11 visual */
+	int screen = DefaultScreen(display);
+	Window root = RootWindow(display, screen);
+	XVisualInfo vinfo;
+	XImage *image;
+	int i;
+	if (!XMatchVisualInfo(display, screen, bitsPerPixel, TrueColor, &vinfo)) {
+		/* Not matched; Use the default visual instead */
+		int numVisuals;
+		XVisualInfo *xvi;
+
+		vinfo.screen = screen;
+		xvi = XGetVisualInfo(display, VisualScreenMask, &vinfo, &numVisuals);
+		assert(xvi);
+
+		vinfo = *xvi;
+		XFree(xvi);
+	}
+	actor->visual = vinfo.visual;
+	
+	if (vinfo.visual != DefaultVisual(display, screen)) {
+		/* Allocate a private color map. */
+		actor->colormap = XCreateColormap(display, root, 
+			vinfo.visual, AllocNone);
+	} else {
+		actor->colormap = 0;
+	}
+
+	/* Create X11 window for actor */
+	XSetWindowAttributes attr;
+	unsigned long attrmask = CWBorderPixel | CWBackPixel | CWBitGravity;
+	attr.background_pixel = BlackPixel(display, screen);
+	attr.border_pixel = attr.background_pixel;
+	attr.bit_gravity = ForgetGravity;
+	if (actor->colormap) {
+		attr.colormap = actor->colormap;
+		attrmask |= CWColormap;
+	}
+
+	Window window = actor->window = XCreateWindow(display, root,
+		0, 0, width, height, 0, vinfo.depth,
+		InputOutput, vinfo.visual,
+		attrmask, &attr);
+
+	XStoreName(display, window, "sdl_haa window");
+
+	Atom atom = ATOM(_HILDON_WM_WINDOW_TYPE_ANIMATION_ACTOR);
+	XChangeProperty(display, window, ATOM(_NET_WM_WINDOW_TYPE),
+		XA_ATOM, 32, PropModeReplace,
+		(unsigned char *) &atom, 1);
+
+	/* Setup the X Images */
+	Bool use_pixmap = False;
+#ifdef HAVE_XSHM
+	use_pixmap = have_shm && shm_pixmaps && (flags & HAA_ACTOR_SHM_PIXMAP) &&
+		XShmPixmapFormat(display) == ZPixmap;
+#endif
+	actor->back = 0;
+	actor->num_buffers = have_shm && !use_pixmap &&
+		(flags & HAA_ACTOR_DOUBLEBUF) ? 2 : 1;
+	for (i = 0; i < actor->num_buffers; i++) {
+		if (buffer_create(&actor->buffers[i], &vinfo, width, height,
+				use_pixmap) != 0) {
+			/* SDL Error already set */
+			goto cleanup_buffers;
+		}
+	}
+	image = actor->buffers[0].image;
+
+#ifdef HAVE_XSHM
+	if (use_pixmap) {
+		/* The server reads the window contents straight from our memory.
+		 * If it will not, flips just upload the image instead. */
+		HAA_Buffer *buf = &actor->buffers[0];
+		if (buffer_create_pixmap(buf, window) == 0) {
+			XSetWindowBackgroundPixmap(display, window, buf->pixmap);
+		}
+	}
+#endif
+
+	/* Guess alpha mask */
+	Uint32 Amask = 0;
+	if (image->depth == 32) {
+		Amask = ~(vinfo.red_mask | vinfo.green_mask | vinfo.blue_mask);
+	}
+
+	/* Create GC */
+	GC gc = actor->gc = XCreateGC(display, window, 0, NULL);
+	XSetForeground(display, gc, 0xFFFFFFFFU);
+
+	/** Create SDL texture for actor */
+	if (actor_create_surface(actor, image, &vinfo, Amask) != 0) {
+		/* SDL Error already set */
+		goto cleanup_gc;
+	}
+
+	XSelectInput(display, window, PropertyChangeMask);
+	trace_create(actor);
+
+	return actor;
+
+cleanup_gc:
+	XFreeGC(display, gc);
+	i = actor->num_buffers;
+cleanup_buffers:
+	while (i-- > 0) {
+		buffer_free(&actor->buffers[i]);
+	}
+	XDestroyWindow(display, window);
+	if (actor->colormap) XFreeColormap(display, actor->colormap);
+	free(actor);
+
+	XSync(display, True);
+	return NULL;
+}
+
+/** Frees all the resources of an actor not in the actor list. */
+static void actor_destroy(HAA_ActorPriv* actor)
+{
+	int i;
+
+	actor_free_frames(actor);
+	XFreeGC(display, actor->gc);
+	for (i = 0; i < actor->num_buffers; i++) {
+		buffer_free(&actor->buffers[i]);
+	}
+	XDestroyWindow(display, actor->window);
+	trace_window(HAA_TRACE_DESTROY, actor->window);
+	if (actor->colormap)
+		XFreeColormap(display, actor->colormap);
+	SDL_FreeSurface(actor->p.surface);
+	if (actor->image_surface) SDL_FreeSurface(actor->image_surface);
+	free(actor->pixels);
+	free(actor->shadow);
+
+	free(actor);
+}
+
+/** Size of all the images of an actor, in bytes. */
+static Uint32 actor_image_bytes(HAA_ActorPriv* actor)
+{
+	Uint32 bytes = 0;
+	int i;
+
+	for (i = 0; i < actor->num_buffers; i++) {
+		XImage *image = actor->buffers[i].image;
+		bytes += image->bytes_per_line * image->height;
+	}
+	if (actor->pixels) {
+		bytes += actor->p.surface->pitch * actor->height;
+	}
+
+	return bytes;
+}
+
+/** Adds an actor to the actor list. */
+static void actor_link(HAA_ActorPriv* actor)
+{
+	XSaveContext(display, actor->window, actor_context, (XPointer) actor);
+	if (first == NULL) {
+		assert(last == NULL);
+		actor->next = actor->prev = NULL;
+		first = last = actor;
+	} else {
+		last->next = actor;
+		actor->prev = last;
+		actor->next = NULL;
+		last = actor;
+	}
+}
+
+/** Removes an actor from the actor list. */
+static void actor_unlink(HAA_ActorPriv* actor)
+{
+	XDeleteContext(display, actor->window, actor_context);
+	if (first == actor && last == actor) {
+		assert(!actor->next && !actor->prev);
+		first = NULL;
+		last = NULL;
+	} else if (last == actor) {
+		assert(!actor->next && actor->prev);
+		last = actor->prev;
+		last->next = NULL;
+	} else if (first == actor) {
+		assert(actor->next && !actor->prev);
+		first = actor->next;
+		first->prev = NULL;
+	} else {
+		assert(actor->next && actor->prev);
+		actor->prev->next = actor->next;
+		actor->next->prev = actor->prev;
+	}
+}
+
+/** Destroys pooled actors until the pool is within its limits. */
+static void pool_trim(void)
+{
+	while (pool_first &&
+			(pool_count > pool_max_actors || pool_bytes > pool_max_bytes)) {
+		HAA_ActorPriv* actor = pool_first;
+		pool_first = actor->next;
+		pool_count--;
+		pool_bytes -= actor_image_bytes(actor);
+		actor_destroy(actor);
+	}
+}
+
+/** Tries to keep an unlinked and unmapped actor for later reuse.
+  * @return True if the actor is now in the pool. */
+static Bool pool_park(HAA_ActorPriv* actor)
+{
+	Uint32 bytes = actor_image_bytes(actor);
+
+	if (pool_count + 1 > pool_max_actors ||
+			pool_bytes + bytes > pool_max_bytes) {
+		return False;
+	}
+
+	/* The compositor will tell us again when it is ready. */
+	actor->reparent_time = 0;
+	XDeleteProperty(display, actor->window,
+		ATOM(_HILDON_ANIMATION_CLIENT_READY));
+	actor_free_frames(actor);
+	/* Whatever the window shows now is of no use to the next user. */
+	actor->shadow_valid = False;
+
+	actor->prev = NULL;
+	actor->next = pool_first;
+	pool_first = actor;
+	pool_count++;
+	pool_bytes += bytes;
+
+	return True;
+}
+
+/** Takes a compatible actor out of the pool, if any. */
+static HAA_ActorPriv* pool_take(Uint32 flags,
+	int width, int height, int bitsPerPixel)
+{
+	HAA_ActorPriv *actor, **prev = &pool_first;
+	int i;
+
+	for (actor = pool_first; actor; prev = &actor->next, actor = actor->next) {
+		if (actor->flags == flags && actor->width == width &&
+				actor->height == height && actor->bpp == bitsPerPixel) {
+			break;
+		}
+	}
+
+	if (!actor) return NULL;
+
+	*prev = actor->next;
+	pool_count--;
+	pool_bytes -= actor_image_bytes(actor);
+
+	/* Give it back as if it was new: first buffer, cleared. */
+	for (i = 0; i < actor->num_buffers; i++) {
+		XImage *image = actor->buffers[i].image;
+		buffer_wait(&actor->buffers[i]);
+		memset(image->data, 0, image->bytes_per_line * image->height);
+	}
+	actor->back = 0;
+	if (actor->pixels) {
+		memset(actor->pixels, 0, actor->p.surface->pitch * actor->height);
+		actor->prev_numrects = 0;
+	} else {
+		actor->p.surface->pixels = actor->buffers[0].image->data;
+	}
+
+	return actor;
+}
+
+HAA_Actor* HAA_CreateActor(Uint32 flags,
+	int width, int height, int bitsPerPixel)
+{
+	HAA_ActorPriv *actor;
+	Bool pooled = True;
+
+#ifdef HAVE_XCB
+	/* Refresh the parent_window if needed, but do not wait for the answer
+	 * until the actor has been created. The query then rides along with the
+	 * creation sync, saving one of the two round trips of the Xlib build;
+	 * a new actor that needs a new shm slab still waits for the server once
+	 * more in slab_create(). */
+	SDL_Surface *screen = SDL_GetVideoSurface();
+	if (!screen) {
+		SDL_SetError("Failed to get current video surface");
+		return NULL;
+	}
+	xcb_connection_t *c = XGetXCBConnection(display);
+	Bool fullscreen = screen->flags & SDL_FULLSCREEN ? True : False;
+	Window new_parent = auto_parent(fullscreen);
+	watch_sdl_windows();
+	xcb_get_window_attributes_cookie_t cookie =
+		xcb_get_window_attributes(c, new_parent);
+#else
+	/* Refresh the parent_window if needed. */
+	int res = HAA_SetVideoMode();
+	if (res != 0) {
+		return NULL;
+	}
+#endif
+
+	unsigned long serial = track_begin();
+
+	actor = pool_take(flags, width, height, bitsPerPixel);
+	if (!actor) {
+		actor = actor_new(flags, width, height, bitsPerPixel);
+		if (!actor) {
+			/* SDL Error already set */
+#ifdef HAVE_XCB
+			xcb_discard_reply(c, cookie.sequence);
+#endif
+			return NULL;
+		}
+		pooled = False;
+	}
+
+	/* Default actor settings */
+	actor_set_defaults(actor);
+
+	/* Map X11 window */
+	XMapWindow(display, actor->window);
+	trace_window(HAA_TRACE_MAP, actor->window);
+
+	/* Add to actor linked list */
+	lock_actors();
+	actor_link(actor);
+	unlock_actors();
+
+	track_end(actor, HAA_OP_CREATE, serial);
+	if (pooled) {
+		/* Nothing new was allocated, so nothing to wait for. */
+		XFlush(display);
+	} else if (submit_display) {
+		/* The submission thread may use the window right away. */
+		wait_for_server();
+	} else {
+		sync_display(False);
+	}
+
+#ifdef HAVE_XCB
+	/* If we synced above, the reply is here already. */
+	xcb_get_window_attributes_reply_t *attr =
+		xcb_get_window_attributes_reply(c, cookie, NULL);
+	Bool is_mapped = attr && attr->map_state == XCB_MAP_STATE_VIEWABLE;
+	free(attr);
+	if (auto_reparent_to(new_parent, is_mapped) != 0) {
+		queue_auto_reparent_to(fullscreen);
+	}
+#endif
+
+	if (submit_display) {
+		HAA_Command *cmd = submit_new(HAA_CMD_ADD, actor);
+		if (!cmd) {
+			HAA_FreeActor((HAA_Actor*) actor);
+			return NULL;
+		}
+		submit_post(cmd);
+	}
+
+	return (HAA_Actor*) actor;
+}
+	
+void HAA_FreeActor(HAA_Actor* a)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+	if (!a) return;
+
+	track_forget(actor);
+	timelines_forget(actor);
+	HAA_RemoveFromGroup(a);
+
+	/* Remove actor from global linked list */
+	lock_actors();
+	actor_unlink(actor);
+	unlock_actors();
+
+	if (submit_display) {
+		/* Let the submission thread finish with it first. */
+		HAA_Command cmd;
+		cmd.type = HAA_CMD_REMOVE;
+		cmd.actor = actor;
+		submit_call(&cmd);
+	}
+
+	XUnmapWindow(display, actor->window);
+	trace_window(HAA_TRACE_UNMAP, actor->window);
+	if (!pool_park(actor)) {
+		actor_destroy(actor);
+	}
+
+	XFlush(display);
+}
+
+int HAA_ResizeActor(HAA_Actor* a, int width, int height)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+	const int old_width = actor->width, old_height = actor->height;
+	HAA_Buffer next[2];
+	int i;
+
+	if (width <= 0 || height <= 0) {
+		SDL_SetError("Invalid actor size");
+		return -1;
+	}
+	if (width == old_width && height == old_height) return 0;
+
+	/* Nobody may be reading from the old images. */
+	for (i = 0; i < actor->num_buffers; i++) {
+		buffer_wait(&actor->buffers[i]);
+	}
+
+	/* Build everything new first; the actor is not touched until
+	 * nothing else can fail. */
+	for (i = 0; i < actor->num_buffers; i++) {
+		if (buffer_resize_prepare(&actor->buffers[i], &next[i],
+				actor->visual, width, height) != 0) {
+			/* SDL Error already set */
+			goto cleanup_buffers;
+		}
+	}
+
+	XImage *image = next[actor->back].image;
+	SDL_Surface *old_surface = actor->p.surface, *old_image_surface =
+		actor->image_surface;
+	void *old_pixels = actor->pixels;
+	const HAA_Convert old_convert = actor->convert;
+	const int old_numrects = actor->prev_numrects;
+	XVisualInfo vinfo;
+	Uint32 Amask = 0;
+
+	vinfo.visual = actor->visual;
+	vinfo.depth = image->depth;
+	vinfo.red_mask = actor->visual->red_mask;
+	vinfo.green_mask = actor->visual->green_mask;
+	vinfo.blue_mask = actor->visual->blue_mask;
+	if (image->depth == 32) {
+		Amask = ~(vinfo.red_mask | vinfo.green_mask | vinfo.blue_mask);
+	}
+
+	actor->width = width;
+	actor->height = height;
+	if (actor_create_surface(actor, image, &vinfo, Amask) != 0) {
+		/* SDL Error already set */
+		actor->width = old_width;
+		actor->height = old_height;
+		actor->p.surface = old_surface;
+		actor->image_surface = old_image_surface;
+		actor->pixels = old_pixels;
+		actor->convert = old_convert;
+		actor->prev_numrects = old_numrects;
+		goto cleanup_buffers;
+	}
+
+#ifdef HAVE_XSHM
+	const Bool had_pixmap = actor->buffers[0].pixmap != None;
+	if (had_pixmap) {
+		/* On failure, the window just goes without a background. */
+		buffer_create_pixmap(&next[0], actor->window);
+	}
+#endif
+
+	/* Commit: from here on nothing can fail. */
+	SDL_FreeSurface(old_surface);
+	if (old_image_surface) SDL_FreeSurface(old_image_surface);
+	free(old_pixels);
+
+	/* Frames of the old size are of no use. */
+	if (actor->frames && submit_display) submit_sync();
+	actor_free_frames(actor);
+	free(actor->shadow);
+	actor->shadow = NULL;
+	actor->shadow_valid = False;
+
+	for (i = 0; i < actor->num_buffers; i++) {
+		buffer_resize_commit(&actor->buffers[i], &next[i]);
+	}
+
+	XResizeWindow(display, actor->window, width, height);
+	trace_resize(actor);
+
+#ifdef HAVE_XSHM
+	if (had_pixmap) {
+		XSetWindowBackgroundPixmap(display, actor->window,
+			actor->buffers[0].pixmap);
+	}
+#endif
+
+	/* Whatever was damaged is gone. */
+	actor->numdamage = 0;
+
+	if (submit_display) {
+		/* The submission thread must see the new size. */
+		wait_for_server();
+	} else {
+		XFlush(display);
+	}
+
+	return 0;
+
+cleanup_buffers:
+	while (i-- > 0) {
+		buffer_resize_abort(&actor->buffers[i], &next[i]);
+	}
+	return -1;
+}
+
+int HAA_SetActorPool(int max_actors, Uint32 max_bytes)
+{
+	pool_max_actors = max_actors > 0 ? max_actors : 0;
+	pool_max_bytes = max_bytes;
+
+	pool_trim();
+	XFlush(display);
+
+	return 0;
+}
+
+int HAA_PrewarmActors(int count, Uint32 flags,
+	int width, int height, int bitsPerPixel)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		HAA_ActorPriv* actor = actor_new(flags, width, height, bitsPerPixel);
+		if (!actor) {
+			/* SDL Error already set */
+			return -1;
+		}
+		if (!pool_park(actor)) {
+			actor_destroy(actor);
+			SDL_SetError("Actor pool is full");
+			return -1;
+		}
+	}
+
+	wait_for_server();
+
+	return 0;
+}
+
+int HAA_Commit(HAA_Actor* a)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+	unsigned long serial;
+	Uint64 start;
+
+	/* HAA_EndFrame will send it, merged with any other changes. */
+	if (in_frame) return 0;
+
+	start = stat_time();
+	serial = track_begin();
+	HAA_Pending(actor);
+	track_end(actor, HAA_OP_COMMIT, serial);
+	sync_display(False);
+	stat_latency(stats.commit_latency, start);
+
+	return 0;
+}
+
+static Bool rects_overlap(const SDL_Rect *a, const SDL_Rect *b)
+{
+	return a->x < b->x + b->w && b->x < a->x + a->w &&
+		a->y < b->y + b->h && b->y < a->y + a->h;
+}
+
+static void rect_union(SDL_Rect *a, const SDL_Rect *b)
+{
+	int x1 = a->x < b->x ? a->x : b->x;
+	int y1 = a->y < b->y ? a->y : b->y;
+	int x2 = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+	int y2 = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+
+	a->x = x1;
+	a->y = y1;
+	a->w = x2 - x1;
+	a->h = y2 - y1;
+}
+
+/** Clips a list of rectangles to the actor size and merges overlapping ones.
+  * @return number of rectangles written to out (at most MAX_FLIP_RECTS).
+  */
+static int merge_rects(const SDL_Rect *rects, int numrects,
+	int width, int height, SDL_Rect *out)
+{
+	int i, j, count = 0;
+
+	for (i = 0; i < numrects; i++) {
+		int x1 = rects[i].x, y1 = rects[i].y;
+		int x2 = x1 + rects[i].w, y2 = y1 + rects[i].h;
+		SDL_Rect r;
+
+		/* Clip to actor */
+		if (x1 < 0) x1 = 0;
+		if (y1 < 0) y1 = 0;
+		if (x2 > width) x2 = width;
+		if (y2 > height) y2 = height;
+		if (x1 >= x2 || y1 >= y2) continue;
+
+		r.x = x1;
+		r.y = y1;
+		r.w = x2 - x1;
+		r.h = y2 - y1;
+
+		/* Absorb every rectangle we overlap with;
+		 * the union may overlap new ones, so start again after each merge. */
+		for (j = 0; j < count; j++) {
+			if (rects_overlap(&r, &out[j])) {
+				rect_union(&r, &out[j]);
+				out[j] = out[--count];
+				j = -1;
+			}
+		}
+
+		if (count == MAX_FLIP_RECTS) {
+			/* Too many pieces; grow the last one instead. */
+			rect_union(&r, &out[--count]);
+			for (j = 0; j < count; j++) {
+				if (rects_overlap(&r, &out[j])) {
+					rect_union(&r, &out[j]);
+					out[j] = out[--count];
+					j = -1;
+				}
+			}
+		}
+
+		out[count++] = r;
+	}
+
+	return count;
+}
+
+/** Uploads some regions of a buffer to the actor window.
+  * @param notify whether to ask for a completion event.
+  * @return True if a completion event will arrive for the last upload.
+  */
+static Bool buffer_put_rects(HAA_ActorPriv* actor, HAA_Buffer *buf,
+	int numrects, const SDL_Rect *rects, Bool notify)
+{
+	Display *dpy = out_display();
+	Window window = actor->window;
+	GC gc = actor->gc;
+	XImage *image = buf->image;
+	int i;
+
+	STAT_ADD(actor, flips, 1);
+
+#ifdef HAVE_XSHM
+	if (buf->pixmap) {
+		/* Repaint from the background pixmap; no pixels are sent. */
+		for (i = 0; i < numrects; i++) {
+			XClearArea(dpy, window,
+				rects[i].x, rects[i].y, rects[i].w, rects[i].h, False);
+			trace_upload(actor, HAA_TRACE_UPLOAD_CLEAR, &rects[i]);
+		}
+		return False;
+	}
+	if (have_shm) {
+		/* Completion events matter just for the last request
+		 * reading from the buffer. */
+		for (i = 0; i < numrects; i++) {
+			if (notify && i == numrects - 1) {
+				buf->serial = NextRequest(dpy);
+			}
+			XShmPutImage(dpy, window, gc, image,
+				rects[i].x, rects[i].y, rects[i].x, rects[i].y,
+				rects[i].w, rects[i].h, notify && i == numrects - 1);
+			STAT_ADD(actor, bytes_uploaded,
+				rects[i].w * rects[i].h * image->bits_per_pixel / 8);
+			trace_upload(actor, HAA_TRACE_UPLOAD_SHM, &rects[i]);
+		}
+		return notify;
+	}
+#endif
+
+	/* Xlib copies the pixels before returning. */
+	(void) notify;
+	for (i = 0; i < numrects; i++) {
+		XPutImage(dpy, window, gc, image,
+			rects[i].x, rects[i].y, rects[i].x, rects[i].y,
+			rects[i].w, rects[i].h);
+		STAT_ADD(actor, bytes_uploaded,
+			rects[i].w * rects[i].h * image->bits_per_pixel / 8);
+		trace_upload(actor, HAA_TRACE_UPLOAD_PUT, &rects[i]);
+	}
+	return False;
+}
+
+/** Converts some regions of the surface into the image of a buffer. */
+static void buffer_convert_rects(HAA_ActorPriv* actor, HAA_Buffer *buf,
+	int numrects, const SDL_Rect *rects)
+{
+	SDL_Surface *surface = actor->p.surface;
+	XImage *image = buf->image;
+	const int src_bpp = surface->format->BytesPerPixel;
+	const int dst_bpp = image->bits_per_pixel / 8;
+	int i, y;
+
+	for (i = 0; i < numrects; i++) {
+		SDL_Rect r = rects[i];
+
+		if (actor->convert == HAA_CONVERT_BLIT) {
+			SDL_Rect dst = r;
+			actor->image_surface->pixels = image->data;
+			SDL_BlitSurface(surface, &r, actor->image_surface, &dst);
+			continue;
+		}
+
+		const Uint8 *src = (const Uint8*) surface->pixels +
+			r.y * surface->pitch + r.x * src_bpp;
+		Uint8 *dst = (Uint8*) image->data +
+			r.y * image->bytes_per_line + r.x * dst_bpp;
+
+		for (y = r.y; y < r.y + r.h; y++) {
+			switch (actor->convert) {
+			case HAA_CONVERT_8888_565:
+				HAA_ConvertRow_8888_565((const Uint32*) src, (Uint16*) dst,
+					r.w);
+				break;
+			case HAA_CONVERT_8888_565_DITHER:
+				HAA_ConvertRow_8888_565_Dither((const Uint32*) src,
+					(Uint16*) dst, r.w, r.x, y);
+				break;
+			case HAA_CONVERT_565_8888:
+				HAA_ConvertRow_565_8888((const Uint16*) src, (Uint32*) dst,
+					r.w);
+				break;
+			case HAA_CONVERT_PREMULTIPLY:
+				HAA_ConvertRow_Premultiply((const Uint32*) src,
+					(Uint32*) dst, r.w);
+				break;
+			default:
+				assert(0);
+				break;
+			}
+			src += surface->pitch;
+			dst += image->bytes_per_line;
+		}
+	}
+}
+
+/** Hands an upload of the back buffer to the submission thread. */
+static void submit_flip(HAA_ActorPriv* actor,
+	int numrects, const SDL_Rect *rects)
+{
+	HAA_Command *cmd = submit_new(HAA_CMD_FLIP, actor);
+	if (!cmd) return;
+
+	assert(numrects <= MAX_FLIP_RECTS);
+	cmd->u.flip.buffer = actor->back;
+	cmd->u.flip.numrects = numrects;
+	memcpy(cmd->u.flip.rects, rects, numrects * sizeof(SDL_Rect));
+
+	/* Nobody else looks at the flag of a buffer that is not busy. */
+	actor->buffers[actor->back].busy = True;
+	submit_post(cmd);
+}
+
+/** Uploads some regions of the back buffer to the actor window
+  * and, if double buffered, swaps buffers. Does not sync.
+  */
+static void actor_put_rects(HAA_ActorPriv* actor,
+	int numrects, const SDL_Rect *rects)
+{
+	HAA_Buffer *buf = &actor->buffers[actor->back];
+
+	/* Whatever was damaged is about to be on screen (or never will be). */
+	actor->numdamage = 0;
+
+	if (numrects <= 0) return;
+
+	if (actor->pixels) {
+		/* The back buffer also missed what changed in the previous flip. */
+		buffer_convert_rects(actor, buf, actor->prev_numrects,
+			actor->prev_rects);
+		buffer_convert_rects(actor, buf, numrects, rects);
+		if (actor->num_buffers > 1) {
+			memcpy(actor->prev_rects, rects, numrects * sizeof(SDL_Rect));
+			actor->prev_numrects = numrects;
+		}
+	}
+
+	if (submit_display) {
+		submit_flip(actor, numrects, rects);
+	} else if (buffer_put_rects(actor, buf, numrects, rects,
+			actor->num_buffers > 1)) {
+		/* Only double buffered actors care about completion events. */
+		buf->busy = True;
+	}
+
+	if (actor->num_buffers > 1) {
+		/* Swap buffers */
+		actor->back = !actor->back;
+		buf = &actor->buffers[actor->back];
+		buffer_wait(buf);
+		if (!actor->pixels) actor->p.surface->pixels = buf->image->data;
+	}
+}
+
+/** Double buffered actors do not need to wait for the server;
+  * otherwise we cannot let the app touch a shared memory surface
+  * until the server is done reading it. */
+static void actor_sync(HAA_ActorPriv* actor)
+{
+	if (submit_display) {
+		/* Double buffered ones waited for their next buffer already. */
+		if (actor->num_buffers == 1) buffer_wait(&actor->buffers[0]);
+	} else if (actor->num_buffers > 1) {
+		XFlush(display);
+	} else {
+		sync_display(have_shm);
+	}
+}
+
+/** Copies a frame uploaded by HAA_SetFrames to the actor window.
+  * Does not sync. */
+static void actor_show_frame(HAA_ActorPriv* actor, int frame)
+{
+	Display *dpy = out_display();
+	SDL_Rect all = { 0, 0, actor->width, actor->height };
+	const int x = (frame % actor->frames_per_row) * actor->width;
+	const int y = (frame / actor->frames_per_row) * actor->height;
+
+#ifdef HAVE_XSHM
+	if (actor->buffers[0].pixmap) {
+		/* The background pixmap would paint over it on the next expose. */
+		XCopyArea(dpy, actor->frames, actor->buffers[0].pixmap, actor->gc,
+			x, y, all.w, all.h, 0, 0);
+		XClearWindow(dpy, actor->window);
+	} else
+#endif
+	{
+		XCopyArea(dpy, actor->frames, actor->window, actor->gc,
+			x, y, all.w, all.h, 0, 0);
+	}
+	trace_upload(actor, HAA_TRACE_UPLOAD_COPY, &all);
+}
+
+/** Whether a tile of the surface differs from the shadow copy. */
+static Bool tile_changed(HAA_ActorPriv* actor, const SDL_Rect *tile)
+{
+	SDL_Surface *surface = actor->p.surface;
+	const int bpp = surface->format->BytesPerPixel;
+	const size_t offset = (size_t) tile->y * surface->pitch + tile->x * bpp;
+	const Uint8 *row = (const Uint8*) surface->pixels + offset;
+	const Uint8 *shadow = actor->shadow + offset;
+	int y;
+
+	for (y = 0; y < tile->h; y++) {
+		if (HAA_RowsDiffer(row, shadow, tile->w * bpp)) return True;
+		row += surface->pitch;
+		shadow += surface->pitch;
+	}
+
+	return False;
+}
+
+/** Copies the given rectangles of the surface into the shadow copy. */
+static void shadow_update(HAA_ActorPriv* actor,
+	int numrects, const SDL_Rect *rects)
+{
+	SDL_Surface *surface = actor->p.surface;
+	const int bpp = surface->format->BytesPerPixel;
+	int i, y;
+
+	for (i = 0; i < numrects; i++) {
+		const size_t offset = (size_t) rects[i].y * surface->pitch +
+			rects[i].x * bpp;
+		const Uint8 *row = (const Uint8*) surface->pixels + offset;
+		Uint8 *shadow = actor->shadow + offset;
+		for (y = 0; y < rects[i].h; y++) {
+			memcpy(shadow, row, rects[i].w * bpp);
+			row += surface->pitch;
+			shadow += surface->pitch;
+		}
+	}
+}
+
+/** With HAA_ACTOR_AUTO_DAMAGE, finds the regions of the surface that
+  * changed since the last flip, and remembers them as flipped.
+  * @return number of rectangles written to out (at most MAX_FLIP_RECTS).
+  */
+static int actor_find_damage(HAA_ActorPriv* actor, SDL_Rect *out)
+{
+	SDL_Surface *surface = actor->p.surface;
+	const size_t size = (size_t) actor->height * surface->pitch;
+	SDL_Rect found[MAX_DAMAGE_RUNS];
+	int numfound = 0, count, i, y;
+
+	if (!actor->shadow) {
+		actor->shadow = malloc(size);
+		if (!actor->shadow) {
+			/* Just flip everything. */
+			out[0].x = out[0].y = 0;
+			out[0].w = actor->width;
+			out[0].h = actor->height;
+			return 1;
+		}
+	}
+	if (!actor->shadow_valid) {
+		memcpy(actor->shadow, surface->pixels, size);
+		actor->shadow_valid = True;
+		out[0].x = out[0].y = 0;
+		out[0].w = actor->width;
+		out[0].h = actor->height;
+		return 1;
+	}
+
+	for (y = 0; y < actor->height; y += DAMAGE_TILE) {
+		SDL_Rect tile = { 0, y, DAMAGE_TILE, DAMAGE_TILE };
+		SDL_Rect run = { 0, y, 0, 0 };
+
+		if (tile.y + tile.h > actor->height) tile.h = actor->height - tile.y;
+
+		/* Changed tiles next to each other make a single rectangle... */
+		for (tile.x = 0; tile.x < actor->width; tile.x += DAMAGE_TILE) {
+			if (tile.x + tile.w > actor->width) tile.w = actor->width - tile.x;
+			if (tile_changed(actor, &tile)) {
+				if (!run.w) run.x = tile.x;
+				run.w = tile.x + tile.w - run.x;
+				run.h = tile.h;
+				if (tile.x + tile.w < actor->width) continue;
+			}
+			if (!run.w) continue;
+
+			/* ... and so do equal runs in consecutive rows of tiles. */
+			for (i = numfound - 1; i >= 0; i--) {
+				if (found[i].x == run.x && found[i].w == run.w &&
+						found[i].y + found[i].h == run.y) {
+					found[i].h += run.h;
+					break;
+				}
+			}
+			if (i < 0) {
+				if (numfound == MAX_DAMAGE_RUNS) {
+					numfound = merge_rects(found, numfound,
+						actor->width, actor->height, out);
+					memcpy(found, out, numfound * sizeof(SDL_Rect));
+				}
+				found[numfound++] = run;
+			}
+			run.w = 0;
+		}
+	}
+
+	count = merge_rects(found, numfound, actor->width, actor->height, out);
+	shadow_update(actor, count, out);
+
+	return count;
+}
+
+/** Uploads the whole surface, or with HAA_ACTOR_AUTO_DAMAGE just what
+  * changed. Does not sync. */
+static void actor_put_all(HAA_ActorPriv* actor)
+{
+	SDL_Rect rects[MAX_FLIP_RECTS];
+
+	if (actor->flags & HAA_ACTOR_AUTO_DAMAGE) {
+		actor_put_rects(actor, actor_find_damage(actor, rects), rects);
+	} else {
+		rects[0].x = rects[0].y = 0;
+		rects[0].w = actor->width;
+		rects[0].h = actor->height;
+		actor_put_rects(actor, 1, rects);
+	}
+}
+
+int HAA_Flip(HAA_Actor* a)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+	Uint64 start = stat_time();
+	unsigned long serial = track_begin();
+
+	actor_put_all(actor);
+
+	/* HAA_EndFrame will send the changes. */
+	if (!in_frame) HAA_Pending(actor);
+	track_end(actor, HAA_OP_FLIP, serial);
+	actor_sync(actor);
+	stat_latency(stats.flip_latency, start);
+
+	return 0;
+}
+
+int HAA_FlipRects(HAA_Actor* a, int numrects, const SDL_Rect *rects)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+	SDL_Rect merged[MAX_FLIP_RECTS];
+	Uint64 start = stat_time();
+	unsigned long serial = track_begin();
+	int count;
+
+	count = merge_rects(rects, numrects, actor->width, actor->height, merged);
+
+	/* All of these end up in the same output buffer; one sync for them all. */
+	actor_put_rects(actor, count, merged);
+	if (actor->shadow_valid) {
+		/* The window shows these now; auto damage must compare with that. */
+		shadow_update(actor, count, merged);
+	}
+
+	/* HAA_EndFrame will send the changes. */
+	if (!in_frame) HAA_Pending(actor);
+	track_end(actor, HAA_OP_FLIP, serial);
+	actor_sync(actor);
+	stat_latency(stats.flip_latency, start);
+
+	return 0;
+}
+
+int HAA_SetFrames(HAA_Actor* a, SDL_Surface *sheet)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+	HAA_Buffer *buf = &actor->buffers[actor->back];
+	XImage *image = buf->image;
+	const int cols = sheet->w / actor->width, rows = sheet->h / actor->height;
+	SDL_Rect all = { 0, 0, actor->width, actor->height };
+	const Uint32 sheet_flags = sheet->flags & SDL_SRCALPHA;
+	const Uint8 sheet_alpha = sheet->format->alpha;
+	int i;
+
+	if (cols == 0 || rows == 0) {
+		SDL_SetError("Sprite sheet smaller than the actor");
+		return -1;
+	}
+
+	if (submit_display) {
+		/* Let it finish copying from the old frames. */
+		submit_sync();
+	}
+	actor_free_frames(actor);
+	actor->frames = XCreatePixmap(display, actor->window,
+		cols * actor->width, rows * actor->height, image->depth);
+	actor->frames_per_row = cols;
+
+	/* Frames go through the surface and back buffer, to be converted
+	 * like any flip, but end up in the pixmap instead of the window. */
+	buffer_wait(buf);
+	/* Copy the alpha channel instead of blending with it. */
+	SDL_SetAlpha(sheet, 0, SDL_ALPHA_OPAQUE);
+	for (i = 0; i < cols * rows; i++) {
+		SDL_Rect src = { (i % cols) * actor->width, (i / cols) * actor->height,
+			actor->width, actor->height };
+		/* Colorkeyed pixels are left alone. */
+		HAA_Fill(a, NULL, 0);
+		if (HAA_Blit(a, 0, 0, sheet, &src) != 0) break;
+		if (actor->pixels) {
+			buffer_convert_rects(actor, buf, 1, &all);
+		}
+		XPutImage(display, actor->frames, actor->gc, image,
+			0, 0, src.x, src.y, src.w, src.h);
+		STAT_ADD(actor, bytes_uploaded,
+			src.w * src.h * image->bits_per_pixel / 8);
+		trace_upload(actor, HAA_TRACE_UPLOAD_PUT, &all);
+	}
+	SDL_SetAlpha(sheet, sheet_flags, sheet_alpha);
+
+	/* The surface is not on screen; the frames are. */
+	actor->numdamage = 0;
+	if (actor->pixels && actor->num_buffers > 1) {
+		/* The other buffer has not seen the surface as it is now. */
+		actor->prev_rects[0] = all;
+		actor->prev_numrects = 1;
+	}
+
+	if (i < cols * rows) {
+		/* SDL Error already set */
+		actor_free_frames(actor);
+		return -1;
+	}
+	actor->num_frames = i;
+
+	/* So that the submission thread does not copy from an empty pixmap. */
+	wait_for_server();
+
+	return actor->num_frames;
+}
+
+int HAA_SetFrame(HAA_Actor* a, int frame)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+	Uint64 start = stat_time();
+	unsigned long serial;
+
+	if (frame < 0 || frame >= actor->num_frames) {
+		SDL_SetError("Invalid frame");
+		return -1;
+	}
+
+	serial = track_begin();
+	if (submit_display) {
+		HAA_Command *cmd = submit_new(HAA_CMD_FRAME, actor);
+		if (!cmd) return -1;
+		cmd->u.frame = frame;
+		submit_post(cmd);
+	} else {
+		actor_show_frame(actor, frame);
+	}
+	/* The window no longer shows the last flip. */
+	actor->shadow_valid = False;
+
+	/* HAA_EndFrame will send the changes. */
+	if (!in_frame) HAA_Pending(actor);
+	track_end(actor, HAA_OP_FLIP, serial);
+	if (!submit_display) XFlush(display);
+	stat_latency(stats.flip_latency, start);
+
+	return 0;
+}
+
+int HAA_FlipDamage(HAA_Actor* a)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+
+	return HAA_FlipRects(a, actor->numdamage, actor->damage);
+}
+
+void HAA_AddDamage(HAA_Actor* a, const SDL_Rect *rect)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+	SDL_Rect rects[MAX_FLIP_RECTS + 1];
+	int n = actor->numdamage;
+
+	memcpy(rects, actor->damage, n * sizeof(SDL_Rect));
+	if (rect) {
+		rects[n] = *rect;
+	} else {
+		rects[n].x = rects[n].y = 0;
+		rects[n].w = actor->width;
+		rects[n].h = actor->height;
+	}
+	actor->numdamage = merge_rects(rects, n + 1,
+		actor->width, actor->height, actor->damage);
+}
+
+/** Whether a surface stores pixels as 0x??RRGGBB words. */
+static Bool format_is_8888(const SDL_PixelFormat *f)
+{
+	return f->BitsPerPixel == 32 && f->Rmask == 0x00FF0000 &&
+		f->Gmask == 0x0000FF00 && f->Bmask == 0x000000FF;
+}
+
+static Bool format_is_565(const SDL_PixelFormat *f)
+{
+	return f->BitsPerPixel == 16 && f->Rmask == 0xF800 &&
+		f->Gmask == 0x07E0 && f->Bmask == 0x001F;
+}
+
+int HAA_Fill(HAA_Actor* a, const SDL_Rect *rect, Uint32 color)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+	SDL_Surface *surface = actor->p.surface;
+	SDL_Rect r = { 0, 0, actor->width, actor->height };
+	int y;
+
+	/* Clip to actor */
+	if (rect && merge_rects(rect, 1, actor->width, actor->height, &r) == 0) {
+		return 0;
+	}
+
+	Uint8 *row = (Uint8*) surface->pixels + r.y * surface->pitch +
+		r.x * surface->format->BytesPerPixel;
+	switch (surface->format->BytesPerPixel) {
+	case 4:
+		for (y = 0; y < r.h; y++, row += surface->pitch) {
+			HAA_FillRow_32((Uint32*) row, color, r.w);
+		}
+		break;
+	case 2:
+		for (y = 0; y < r.h; y++, row += surface->pitch) {
+			HAA_FillRow_16((Uint16*) row, color, r.w);
+		}
+		break;
+	default:
+		if (SDL_FillRect(surface, &r, color) != 0) return -1;
+		break;
+	}
+
+	HAA_AddDamage(a, &r);
+	return 0;
+}
+
+/** Clips a blit of src (or its srcrect part) to (x, y) on an actor.
+  * @return False if nothing is left to draw. */
+static Bool clip_blit(HAA_ActorPriv* actor, int x, int y,
+	SDL_Surface *src, const SDL_Rect *srcrect, SDL_Rect *s, SDL_Rect *d)
+{
+	int sx = 0, sy = 0, w = src->w, h = src->h;
+
+	if (srcrect) {
+		sx = srcrect->x;
+		sy = srcrect->y;
+		w = srcrect->w;
+		h = srcrect->h;
+		/* Clip to src, moving the destination along. */
+		if (sx < 0) { w += sx; x -= sx; sx = 0; }
+		if (sy < 0) { h += sy; y -= sy; sy = 0; }
+		if (sx + w > src->w) w = src->w - sx;
+		if (sy + h > src->h) h = src->h - sy;
+	}
+
+	/* Clip to actor */
+	if (x < 0) { w += x; sx -= x; x = 0; }
+	if (y < 0) { h += y; sy -= y; y = 0; }
+	if (x + w > actor->width) w = actor->width - x;
+	if (y + h > actor->height) h = actor->height - y;
+	if (w <= 0 || h <= 0) return False;
+
+	s->x = sx;
+	s->y = sy;
+	d->x = x;
+	d->y = y;
+	s->w = d->w = w;
+	s->h = d->h = h;
+
+	return True;
+}
+
+/** Kinds of blit done by actor_blit. */
+typedef enum HAA_BlitOp {
+	HAA_BLIT_COPY,
+	HAA_BLIT_8888_8888,
+	HAA_BLIT_8888_565,
+	HAA_BLIT_SDL
+} HAA_BlitOp;
+
+static int actor_blit(HAA_ActorPriv* actor, int x, int y,
+	SDL_Surface *src, const SDL_Rect *srcrect, HAA_BlitOp op)
+{
+	SDL_Surface *surface = actor->p.surface;
+	SDL_Rect s, d;
+	int i;
+
+	if (!clip_blit(actor, x, y, src, srcrect, &s, &d)) return 0;
+
+	if (op == HAA_BLIT_SDL) {
+		if (SDL_BlitSurface(src, &s, surface, &d) != 0) return -1;
+		HAA_AddDamage(&actor->p, &d);
+		return 0;
+	}
+
+	if (SDL_MUSTLOCK(src) && SDL_LockSurface(src) != 0) return -1;
+
+	const int sbpp = src->format->BytesPerPixel;
+	const int dbpp = surface->format->BytesPerPixel;
+	const Uint8 *srow = (const Uint8*) src->pixels +
+		s.y * src->pitch + s.x * sbpp;
+	Uint8 *drow = (Uint8*) surface->pixels +
+		d.y * surface->pitch + d.x * dbpp;
+
+	for (i = 0; i < d.h; i++) {
+		switch (op) {
+		case HAA_BLIT_COPY:
+			memcpy(drow, srow, d.w * dbpp);
+			break;
+		case HAA_BLIT_8888_8888:
+			HAA_BlendRow_8888_8888((const Uint32*) srow, (Uint32*) drow, d.w);
+			break;
+		case HAA_BLIT_8888_565:
+			HAA_BlendRow_8888_565((const Uint32*) srow, (Uint16*) drow, d.w);
+			break;
+		default:
+			assert(0);
+			break;
+		}
+		srow += src->pitch;
+		drow += surface->pitch;
+	}
+
+	if (SDL_MUSTLOCK(src)) SDL_UnlockSurface(src);
+
+	HAA_AddDamage(&actor->p, &d);
+	return 0;
+}
+
+int HAA_Blit(HAA_Actor* a, int x, int y,
+	SDL_Surface *src, const SDL_Rect *srcrect)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+	const SDL_PixelFormat *sf = src->format, *df = a->surface->format;
+	Bool same = sf->BitsPerPixel == df->BitsPerPixel && !sf->palette &&
+		sf->Rmask == df->Rmask && sf->Gmask == df->Gmask &&
+		sf->Bmask == df->Bmask && sf->Amask == df->Amask;
+	/* Only SDL knows how to skip colorkeyed pixels or blend. */
+	Bool plain = !(src->flags & (SDL_SRCCOLORKEY | SDL_SRCALPHA));
+
+	return actor_blit(actor, x, y, src, srcrect,
+		same && plain ? HAA_BLIT_COPY : HAA_BLIT_SDL);
+}
+
+int HAA_BlitAlpha(HAA_Actor* a, int x, int y,
+	SDL_Surface *src, const SDL_Rect *srcrect)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+	const SDL_PixelFormat *df = a->surface->format;
+	HAA_BlitOp op = HAA_BLIT_SDL;
+
+	if (format_is_8888(src->format) && src->format->Amask == 0xFF000000) {
+		if (format_is_8888(df)) {
+			op = HAA_BLIT_8888_8888;
+		} else if (format_is_565(df)) {
+			op = HAA_BLIT_8888_565;
+		}
+	}
+
+	return actor_blit(actor, x, y, src, srcrect, op);
+}
+
+int HAA_CommitAll(void)
+{
+	HAA_ActorPriv* a;
+	Uint64 start;
+
+	if (in_frame) return 0;
+
+	start = stat_time();
+	lock_actors();
+	for (a = first; a; a = a->next) {
+		unsigned long serial = track_begin();
+		HAA_Pending(a);
+		track_end(a, HAA_OP_COMMIT, serial);
+	}
+	unlock_actors();
+	groups_committed();
+
+	sync_display(False);
+	stat_latency(stats.commit_latency, start);
+
+	return 0;
+}
+
+int HAA_FlipAll(void)
+{
+	HAA_ActorPriv* a;
+	Bool need_sync = False;
+	Uint64 start = stat_time();
+
+	lock_actors();
+	for (a = first; a; a = a->next) {
+		unsigned long serial = track_begin();
+
+		actor_put_all(a);
+		if (!in_frame) HAA_Pending(a);
+		track_end(a, HAA_OP_FLIP, serial);
+
+		if (a->num_buffers == 1) need_sync = True;
+	}
+
+	if (submit_display) {
+		/* Wait only after everything has been handed over. */
+		if (need_sync) {
+			for (a = first; a; a = a->next) {
+				actor_sync(a);
+			}
+		}
+		unlock_actors();
+		stat_latency(stats.flip_latency, start);
+		return 0;
+	}
+	unlock_actors();
+
+	/* Same rules as actor_sync(), but once for the entire scene. */
+	if (need_sync) {
+		sync_display(have_shm);
+	} else {
+		XFlush(display);
+	}
+	stat_latency(stats.flip_latency, start);
+
+	return 0;
+}
+
+/** Marks a buffer as no longer being read from. */
+static void submit_buffer_done(HAA_Buffer *buf)
+{
+	SDL_mutexP(submit_lock);
+	buf->busy = False;
+	SDL_CondBroadcast(submit_cond);
+	SDL_mutexV(submit_lock);
+}
+
+/** Sends whatever the compositor is missing, if it is ready. */
+static void submit_pending(HAA_ActorPriv* actor)
+{
+	if (actor->submit_ready && actor->submit_pending) {
+		actor_send_pending(actor, &actor->submit_props,
+			actor->submit_parent, actor->submit_pending);
+		actor->submit_pending = HAA_PENDING_NOTHING;
+	}
+}
+
+/** Executes a command in the submission thread. */
+static void submit_run(HAA_Command *cmd)
+{
+	HAA_ActorPriv *actor = cmd->actor;
+	int i;
+
+	switch (cmd->type) {
+		case HAA_CMD_ADD:
+			XSaveContext(submit_display, actor->window, actor_context,
+				(XPointer) actor);
+			break;
+		case HAA_CMD_REMOVE:
+			/* Once the server is done, nothing reads from the buffers. */
+			XSync(submit_display, False);
+			for (i = 0; i < actor->num_buffers; i++) {
+				submit_buffer_done(&actor->buffers[i]);
+			}
+			XDeleteContext(submit_display, actor->window, actor_context);
+			break;
+		case HAA_CMD_STATE:
+			actor->submit_ready = cmd->u.state.ready;
+			actor->submit_parent = cmd->u.state.parent;
+			actor->submit_pending |= cmd->u.state.resend;
+			if (cmd->u.state.forget) {
+				actor->sent_valid = HAA_PENDING_NOTHING;
+			}
+			submit_pending(actor);
+			break;
+		case HAA_CMD_COMMIT:
+			actor->submit_props = cmd->u.props;
+			actor->submit_pending |= cmd->u.props.pending;
+			submit_pending(actor);
+			break;
+		case HAA_CMD_FLIP: {
+			HAA_Buffer *buf = &actor->buffers[cmd->u.flip.buffer];
+			if (!buffer_put_rects(actor, buf,
+					cmd->u.flip.numrects, cmd->u.flip.rects, True)) {
+				submit_buffer_done(buf);
+			}
+			break;
+		}
+		case HAA_CMD_FRAME:
+			actor_show_frame(actor, cmd->u.frame);
+			break;
+		case HAA_CMD_FENCE:
+			frame_fence_send(submit_display, cmd->u.fence);
+			break;
+		case HAA_CMD_SYNC:
+			XSync(submit_display, False);
+			break;
+#ifdef HAVE_XSHM
+		case HAA_CMD_SHM_ATTACH:
+			XShmAttach(submit_display, &cmd->u.slab->submit_shminfo);
+			XSync(submit_display, False);
+			break;
+		case HAA_CMD_SHM_DETACH:
+			XShmDetach(submit_display, &cmd->u.slab->submit_shminfo);
+			break;
+#endif
+		case HAA_CMD_QUIT:
+			break;
+	}
+
+	if (cmd->sync) {
+		/* The poster owns the command, and may free it as soon as we unlock. */
+		SDL_mutexP(submit_lock);
+		cmd->sync = False;
+		SDL_CondBroadcast(submit_cond);
+		SDL_mutexV(submit_lock);
+	} else {
+		free(cmd);
+	}
+}
+
+/** Handles an event received on the submission thread connection. */
+static void submit_event(XEvent *e)
+{
+#ifdef HAVE_XSHM
+	if (have_shm && e->type == submit_shm_event_base + ShmCompletion) {
+		const XShmCompletionEvent *ce = (const XShmCompletionEvent *) e;
+		XPointer data;
+		if (XFindContext(submit_display, ce->drawable, actor_context,
+				&data) == 0) {
+			SDL_mutexP(submit_lock);
+			actor_shm_completion((HAA_ActorPriv*) data, ce);
+			SDL_CondBroadcast(submit_cond);
+			SDL_mutexV(submit_lock);
+		}
+	}
+#else
+	(void) e;
+#endif
+}
+
+static int submit_main(void *unused)
+{
+	const int xfd = ConnectionNumber(submit_display);
+	Bool quit = False;
+
+	(void) unused;
+
+	while (!quit) {
+		HAA_Command *cmd, *list = NULL;
+
+		/* Take everything queued so far; reverse it to posting order. */
+		cmd = __sync_lock_test_and_set(&submit_queue, NULL);
+		while (cmd) {
+			HAA_Command *next = cmd->next;
+			cmd->next = list;
+			list = cmd;
+			cmd = next;
+		}
+
+		while (list) {
+			cmd = list;
+			list = cmd->next;
+			if (cmd->type == HAA_CMD_QUIT) quit = True;
+			submit_run(cmd);
+		}
+
+		/* This also flushes everything we just sent. */
+		while (XPending(submit_display)) {
+			XEvent e;
+			XNextEvent(submit_display, &e);
+			submit_event(&e);
+		}
+
+		if (!quit && !submit_queue) {
+			fd_set fds;
+			FD_ZERO(&fds);
+			FD_SET(xfd, &fds);
+			FD_SET(submit_wake[0], &fds);
+			select((xfd > submit_wake[0] ? xfd : submit_wake[0]) + 1,
+				&fds, NULL, NULL, NULL);
+			if (FD_ISSET(submit_wake[0], &fds)) {
+				char buf[64];
+				while (read(submit_wake[0], buf, sizeof(buf)) > 0);
+			}
+		}
+	}
+
+	return 0;
+}
+
+/** Opens the second connection and starts the submission thread. */
+static int submit_start(void)
+{
+	submit_queue = NULL;
+
+	if (pipe(submit_wake) != 0) {
+		SDL_SetError("Cannot create pipe");
+		return -1;
+	}
+	fcntl(submit_wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(submit_wake[1], F_SETFL, O_NONBLOCK);
+
+	submit_display = XOpenDisplay(DisplayString(display));
+	if (!submit_display) {
+		SDL_SetError("Cannot open a second X connection");
+		goto cleanup_pipe;
+	}
+#ifdef HAVE_XSHM
+	if (have_shm) {
+		XShmQueryExtension(submit_display);
+		submit_shm_event_base = XShmGetEventBase(submit_display);
+	}
+#endif
+
+	submit_lock = SDL_CreateMutex();
+	submit_cond = SDL_CreateCond();
+	actors_lock = SDL_CreateMutex();
+	if (!submit_lock || !submit_cond || !actors_lock) {
+		/* SDL Error already set */
+		goto cleanup_locks;
+	}
+
+	submit_thread = SDL_CreateThread(submit_main, NULL);
+	if (!submit_thread) {
+		/* SDL Error already set */
+		goto cleanup_locks;
+	}
+
+	return 0;
+
+cleanup_locks:
+	if (submit_lock) SDL_DestroyMutex(submit_lock);
+	if (submit_cond) SDL_DestroyCond(submit_cond);
+	if (actors_lock) SDL_DestroyMutex(actors_lock);
+	submit_lock = NULL;
+	submit_cond = NULL;
+	actors_lock = NULL;
+	XCloseDisplay(submit_display);
+	submit_display = NULL;
+cleanup_pipe:
+	close(submit_wake[0]);
+	close(submit_wake[1]);
+	return -1;
+}
+
+/** Stops the submission thread once it is done with every command. */
+static void submit_stop(void)
+{
+	HAA_Command cmd;
+
+	if (!submit_display) return;
+
+	cmd.type = HAA_CMD_QUIT;
+	cmd.actor = NULL;
+	submit_call(&cmd);
+	SDL_WaitThread(submit_thread, NULL);
+	submit_thread = NULL;
+
+	SDL_DestroyMutex(submit_lock);
+	SDL_DestroyCond(submit_cond);
+	SDL_DestroyMutex(actors_lock);
+	submit_lock = NULL;
+	submit_cond = NULL;
+	actors_lock = NULL;
+	close(submit_wake[0]);
+	close(submit_wake[1]);
+
+	XCloseDisplay(submit_display);
+	submit_display = NULL;
+}
+
+const HAA_Error* HAA_GetError(HAA_Actor* a)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+
+	if (actor->error.operation == HAA_OP_NONE) {
+		return NULL;
+	}
+
+	return &actor->error;
+}
+
+void HAA_ClearError(HAA_Actor* a)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+
+	memset(&actor->error, 0, sizeof(actor->error));
+}
+
+int HAA_IsReady(HAA_Actor* a)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+
+	return actor->ready ? 1 : 0;
+}
+
+/** Eases a progress value, all in 16.16 fixed point between 0 and 1. */
+static Sint64 ease(HAA_Easing easing, Sint64 p)
+{
+	const Sint64 one = 1 << 16;
+	Sint64 q;
+
+	switch (easing) {
+		case HAA_EASE_IN_QUAD:
+			return (p * p) >> 16;
+		case HAA_EASE_OUT_QUAD:
+			q = one - p;
+			return one - ((q * q) >> 16);
+		case HAA_EASE_IN_OUT_QUAD:
+			if (p < one / 2) return (2 * p * p) >> 16;
+			q = one - p;
+			return one - ((2 * q * q) >> 16);
+		case HAA_EASE_IN_CUBIC:
+			return (((p * p) >> 16) * p) >> 16;
+		case HAA_EASE_OUT_CUBIC:
+			q = one - p;
+			return one - ((((q * q) >> 16) * q) >> 16);
+		case HAA_EASE_IN_OUT_CUBIC:
+			if (p < one / 2) return (4 * ((p * p) >> 16) * p) >> 16;
+			q = one - p;
+			return one - ((4 * ((q * q) >> 16) * q) >> 16);
+		case HAA_EASE_STEP:
+			return p < one ? 0 : one;
+		case HAA_EASE_LINEAR:
+		default:
+			return p;
+	}
+}
+
+/** Sets an actor property the same way the inline setters do. */
+static void actor_set_property(HAA_ActorPriv* actor,
+	HAA_Property property, Sint32 value)
+{
+	HAA_Actor *p = &actor->p;
+
+	switch (property) {
+		case HAA_PROPERTY_POSITION_X:
+			p->position_x = value;
+			p->pending |= HAA_PENDING_POSITION;
+			break;
+		case HAA_PROPERTY_POSITION_Y:
+			p->position_y = value;
+			p->pending |= HAA_PENDING_POSITION;
+			break;
+		case HAA_PROPERTY_DEPTH:
+			p->depth = value;
+			p->pending |= HAA_PENDING_POSITION;
+			break;
+		case HAA_PROPERTY_SCALE_X:
+			p->scale_x = value;
+			p->pending |= HAA_PENDING_SCALE;
+			break;
+		case HAA_PROPERTY_SCALE_Y:
+			p->scale_y = value;
+			p->pending |= HAA_PENDING_SCALE;
+			break;
+		case HAA_PROPERTY_ROTATION_X:
+			p->x_rotation_angle = value;
+			p->pending |= HAA_PENDING_ROTATION_X;
+			break;
+		case HAA_PROPERTY_ROTATION_Y:
+			p->y_rotation_angle = value;
+			p->pending |= HAA_PENDING_ROTATION_Y;
+			break;
+		case HAA_PROPERTY_ROTATION_Z:
+			p->z_rotation_angle = value;
+			p->pending |= HAA_PENDING_ROTATION_Z;
+			break;
+		case HAA_PROPERTY_OPACITY:
+			p->opacity = value < 0 ? 0 : value > 255 ? 255 : value;
+			p->pending |= HAA_PENDING_SHOW;
+			break;
+		case HAA_PROPERTY_ANCHOR_X:
+			p->gravity = HAA_GRAVITY_NONE;
+			p->anchor_x = value;
+			p->pending |= HAA_PENDING_ANCHOR;
+			break;
+		case HAA_PROPERTY_ANCHOR_Y:
+			p->gravity = HAA_GRAVITY_NONE;
+			p->anchor_y = value;
+			p->pending |= HAA_PENDING_ANCHOR;
+			break;
+	}
+}
+
+#define NUM_PROPERTIES (HAA_PROPERTY_ANCHOR_Y + 1)
+
+/** Sets every property in a timeline to its value at the given time. */
+static void timeline_apply(HAA_Timeline* timeline, Uint32 time)
+{
+	const HAA_Keyframe *prev[NUM_PROPERTIES] = { NULL };
+	const HAA_Keyframe *next[NUM_PROPERTIES] = { NULL };
+	int i;
+
+	/* Find the keyframes around the current time for each property. */
+	for (i = 0; i < timeline->num_keyframes; i++) {
+		const HAA_Keyframe *k = &timeline->keyframes[i];
+		if (k->time <= time) {
+			prev[k->property] = k;
+		} else if (!next[k->property]) {
+			next[k->property] = k;
+		}
+	}
+
+	for (i = 0; i < NUM_PROPERTIES; i++) {
+		if (prev[i] && next[i]) {
+			Sint64 progress = ((Sint64)(time - prev[i]->time) << 16) /
+				(next[i]->time - prev[i]->time);
+			Sint64 delta = (Sint64) next[i]->value - prev[i]->value;
+			actor_set_property(timeline->actor, i, prev[i]->value +
+				((delta * ease(next[i]->easing, progress)) >> 16));
+		} else if (prev[i]) {
+			/* Past the last keyframe. */
+			actor_set_property(timeline->actor, i, prev[i]->value);
+		} else if (next[i]) {
+			/* Hold the first value until we get there. */
+			actor_set_property(timeline->actor, i, next[i]->value);
+		}
+	}
+}
+
+static void timelines_forget(HAA_ActorPriv* actor)
+{
+	HAA_Timeline *t;
+
+	for (t = timelines; t; t = t->next) {
+		if (t->actor == actor) {
+			t->actor = NULL;
+			t->running = False;
+		}
+	}
+}
+
+HAA_Timeline* HAA_CreateTimeline(HAA_Actor* actor)
+{
+	HAA_Timeline *timeline = malloc(sizeof(HAA_Timeline));
+	if (!timeline) {
+		SDL_Error(SDL_ENOMEM);
+		return NULL;
+	}
+
+	timeline->actor = (HAA_ActorPriv*) actor;
+	timeline->keyframes = NULL;
+	timeline->num_keyframes = 0;
+	timeline->loops = 1;
+	timeline->loops_left = 1;
+	timeline->start = 0;
+	timeline->running = False;
+	timeline->next = timelines;
+	timelines = timeline;
+
+	return timeline;
+}
+
+void HAA_FreeTimeline(HAA_Timeline* timeline)
+{
+	HAA_Timeline **t;
+	if (!timeline) return;
+
+	for (t = &timelines; *t != timeline; t = &(*t)->next);
+	*t = timeline->next;
+
+	free(timeline->keyframes);
+	free(timeline);
+}
+
+int HAA_AddKeyframe(HAA_Timeline* timeline, HAA_Property property,
+	Uint32 time, Sint32 value, HAA_Easing easing)
+{
+	HAA_Keyframe *keyframes;
+	int i;
+
+	if ((unsigned) property >= NUM_PROPERTIES) {
+		SDL_SetError("Invalid property");
+		return -1;
+	}
+
+	keyframes = realloc(timeline->keyframes,
+		(timeline->num_keyframes + 1) * sizeof(HAA_Keyframe));
+	if (!keyframes) {
+		SDL_Error(SDL_ENOMEM);
+		return -1;
+	}
+	timeline->keyframes = keyframes;
+
+	/* Keep them sorted by time; equal times stay in insertion order. */
+	for (i = timeline->num_keyframes; i > 0 && keyframes[i - 1].time > time; i--) {
+		keyframes[i] = keyframes[i - 1];
+	}
+	keyframes[i].property = property;
+	keyframes[i].time = time;
+	keyframes[i].value = value;
+	keyframes[i].easing = easing;
+	timeline->num_keyframes++;
+
+	return 0;
+}
+
+void HAA_SetTimelineLoops(HAA_Timeline* timeline, int loops)
+{
+	timeline->loops = loops > 0 ? loops : 0;
+}
+
+void HAA_StartTimeline(HAA_Timeline* timeline)
+{
+	if (!timeline->actor) return;
+
+	timeline->start = SDL_GetTicks();
+	timeline->loops_left = timeline->loops;
+	timeline->running = True;
+}
+
+void HAA_StopTimeline(HAA_Timeline* timeline)
+{
+	timeline->running = False;
+}
+
+int HAA_Animate(void)
+{
+	const Uint32 now = SDL_GetTicks();
+	HAA_Timeline *t;
+	int running = 0;
+	Bool changed = False;
+
+	/* First move everything... */
+	for (t = timelines; t; t = t->next) {
+		Uint32 duration, elapsed;
+		if (!t->running || !t->num_keyframes) continue;
+
+		duration = t->keyframes[t->num_keyframes - 1].time;
+		elapsed = now - t->start;
+
+		while (elapsed >= duration) {
+			if (t->loops_left == 1 || duration == 0) {
+				/* Finished */
+				t->running = False;
+				break;
 			}
+			if (t->loops_left > 1) t->loops_left--;
+			t->start += duration;
+			elapsed -= duration;
 		}
+
+		timeline_apply(t, t->running ? elapsed : duration);
+		if (t->running) running++;
 	}
 
-	return 1; // Unhandled event
+	/* HAA_EndFrame will send the changes. */
+	if (in_frame) return running;
+
+	/* ... then send the changes; a single commit per actor. */
+	for (t = timelines; t; t = t->next) {
+		if (t->actor && t->actor->p.pending) {
+			HAA_Pending(t->actor);
+			changed = True;
+		}
+	}
+
+	if (changed) {
+		sync_display(False);
+	}
+
+	return running;
 }
 
-HAA_Actor* HAA_CreateActor(Uint32 flags,
-	int width, int height, int bitsPerPixel)
+HAA_Group* HAA_CreateGroup(void)
 {
-	HAA_ActorPriv *actor = malloc(sizeof(HAA_ActorPriv));
-	if (!actor) {
+	HAA_Group *group = calloc(1, sizeof(HAA_Group));
+	if (!group) {
 		SDL_Error(SDL_ENOMEM);
 		return NULL;
 	}
 
-	/* Refresh the parent_window if needed. */
-	int res = HAA_SetVideoMode();
-	if (res != 0) {
-		goto cleanup_actor;
-		return NULL;
+	group->t.visible = 1;
+	group->t.opacity = 255;
+	group->t.scale_x = 1 << 16;
+	group->t.scale_y = 1 << 16;
+	group->next = groups;
+	groups = group;
+
+	return group;
+}
+
+void HAA_FreeGroup(HAA_Group* group)
+{
+	HAA_Group **g;
+	int i;
+	if (!group) return;
+
+	/* The children go back to their own transforms on the next commit. */
+	for (i = 0; i < group->num_children; i++) {
+		group->children[i]->group = NULL;
+		group->children[i]->p.pending |= GROUP_PENDING;
 	}
 
-	/* Default actor settings */
-	actor->p.position_x = 0;
-	actor->p.position_y = 0;
-	actor->p.depth = 0;
-	actor->p.visible = 0;
-	actor->p.opacity = 255;
-	actor->parent = parent_window;
-	actor->p.scale_x = 1 << 16;
-	actor->p.scale_y = 1 << 16;
-	actor->p.gravity = HAA_GRAVITY_NONE;
-	actor->p.anchor_x = 0;
-	actor->p.anchor_y = 0;
-	actor->p.x_rotation_angle = 0;
-	actor->p.x_rotation_y = 0;
-	actor->p.x_rotation_z = 0;
-	actor->p.y_rotation_angle = 0;
-	actor->p.y_rotation_x = 0;
-	actor->p.y_rotation_z = 0;
-	actor->p.z_rotation_angle = 0;
-	actor->p.z_rotation_x = 0;
-	actor->p.z_rotation_y = 0;
-	actor->p.pending =
-		HAA_PENDING_POSITION | HAA_PENDING_SCALE | HAA_PENDING_PARENT;
-	actor->ready = 0;
+	for (g = &groups; *g != group; g = &(*g)->next);
+	*g = group->next;
 
-	/* Select the X11 visual */
-	int screen = DefaultScreen(display);
-	Window root = RootWindow(display, screen);
-	XVisualInfo vinfo;
-	XImage *image;
-	void* pixels = NULL;
-	if (!XMatchVisualInfo(display, screen, bitsPerPixel, TrueColor, &vinfo)) {
-		/* Not matched; Use the default visual instead */
-		int numVisuals;
-		XVisualInfo *xvi;
+	free(group->children);
+	free(group);
+}
 
-		vinfo.screen = screen;
-		xvi = XGetVisualInfo(display, VisualScreenMask, &vinfo, &numVisuals);
-		assert(xvi);
+HAA_Actor* HAA_GetGroupTransform(HAA_Group* group)
+{
+	return &group->t;
+}
 
-		vinfo = *xvi;
-		XFree(xvi);
+int HAA_AddToGroup(HAA_Group* group, HAA_Actor* a)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+
+	if (actor->group == group) return 0;
+
+	if (group->num_children == group->max_children) {
+		int max = group->max_children ? group->max_children * 2 : 8;
+		HAA_ActorPriv **children = realloc(group->children,
+			max * sizeof(HAA_ActorPriv*));
+		if (!children) {
+			SDL_Error(SDL_ENOMEM);
+			return -1;
+		}
+		group->children = children;
+		group->max_children = max;
 	}
-	actor->visual = vinfo.visual;
-	
-	if (vinfo.visual != DefaultVisual(display, screen)) {
-		/* Allocate a private color map. */
-		actor->colormap = XCreateColormap(display, root, 
-			vinfo.visual, AllocNone);
-	} else {
-		actor->colormap = 0;
+
+	HAA_RemoveFromGroup(a);
+	group->children[group->num_children++] = actor;
+	actor->group = group;
+	actor->p.pending |= GROUP_PENDING;
+
+	return 0;
+}
+
+void HAA_RemoveFromGroup(HAA_Actor* a)
+{
+	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
+	HAA_Group *group = actor->group;
+	int i;
+
+	if (!group) return;
+
+	for (i = 0; group->children[i] != actor; i++);
+	group->children[i] = group->children[--group->num_children];
+	actor->group = NULL;
+	actor->p.pending |= GROUP_PENDING;
+}
+
+/** Call once every child has seen the latest group transforms. */
+static void groups_committed(void)
+{
+	HAA_Group *g;
+
+	for (g = groups; g; g = g->next) {
+		g->t.pending = HAA_PENDING_NOTHING;
 	}
+}
 
-	/* Create X11 window for actor */
+int HAA_CommitGroup(HAA_Group* group)
+{
+	Uint64 start;
+	int i;
+
+	/* HAA_EndFrame will send it, merged with any other changes. */
+	if (in_frame) return 0;
+
+	start = stat_time();
+	for (i = 0; i < group->num_children; i++) {
+		HAA_ActorPriv *actor = group->children[i];
+		unsigned long serial = track_begin();
+		HAA_Pending(actor);
+		track_end(actor, HAA_OP_COMMIT, serial);
+	}
+	group->t.pending = HAA_PENDING_NOTHING;
+
+	sync_display(False);
+	stat_latency(stats.commit_latency, start);
+
+	return 0;
+}
+
+HAA_FrameClock* HAA_CreateFrameClock(int fps)
+{
+	HAA_FrameClock *clock;
 	XSetWindowAttributes attr;
-	unsigned long attrmask = CWBorderPixel | CWBackPixel | CWBitGravity;
-	attr.background_pixel = BlackPixel(display, screen);
-	attr.border_pixel = attr.background_pixel;
-	attr.bit_gravity = ForgetGravity;
-	if (actor->colormap) {
-		attr.colormap = actor->colormap;
-		attrmask |= CWColormap;
+
+	if (fps <= 0) {
+		SDL_SetError("Invalid frame rate");
+		return NULL;
 	}
 
-	Window window = actor->window = XCreateWindow(display, root,
-		0, 0, width, height, 0, vinfo.depth,
-		InputOutput, vinfo.visual,
-		attrmask, &attr);
+	clock = malloc(sizeof(HAA_FrameClock));
+	if (!clock) {
+		SDL_Error(SDL_ENOMEM);
+		return NULL;
+	}
 
-	XStoreName(display, window, "sdl_haa window");
+	clock->interval = 1000 / fps;
+	clock->next_frame = SDL_GetTicks();
+	clock->skip = 0;
+	clock->latency = 0;
 
-	Atom atom = ATOM(_HILDON_WM_WINDOW_TYPE_ANIMATION_ACTOR);
-	XChangeProperty(display, window, ATOM(_NET_WM_WINDOW_TYPE),
-		XA_ATOM, 32, PropModeReplace,
-		(unsigned char *) &atom, 1);
+	attr.event_mask = PropertyChangeMask;
+	clock->fence = XCreateWindow(display, DefaultRootWindow(display),
+		-1, -1, 1, 1, 0, 0, InputOnly, CopyFromParent, CWEventMask, &attr);
+	clock->fence_pending = False;
+	clock->fence_done = False;
+	clock->fence_overdue = False;
+	clock->next = clocks;
+	clocks = clock;
 
-	/* Setup the X Image */
-	if (have_shm) {
-		image = actor->image = XShmCreateImage(display, vinfo.visual,
-			vinfo.depth, ZPixmap, NULL, &actor->shminfo, width, height);
-		if (!image) {
-			SDL_SetError("Cannot create XSHM image");
-			goto cleanup_window;
-		}
+	return clock;
+}
 
-		actor->shminfo.shmid = shmget(IPC_PRIVATE,
-			image->bytes_per_line * image->height, IPC_CREAT|0777);
-		if (actor->shminfo.shmid < 0) {
-			SDL_SetError("Failed to get shared memory");
-			XDestroyImage(image);
-			goto cleanup_window;
-		}
+void HAA_FreeFrameClock(HAA_FrameClock* clock)
+{
+	HAA_FrameClock **c;
+	if (!clock) return;
 
-		actor->shminfo.shmaddr = shmat(actor->shminfo.shmid, NULL, 0);
-		if (!actor->shminfo.shmaddr) {
-			SDL_SetError("Failed to attach shared memory");
-			XDestroyImage(image);
-			shmctl(actor->shminfo.shmid, IPC_RMID, 0);
-			goto cleanup_window;
-		}
+	for (c = &clocks; *c != clock; c = &(*c)->next);
+	*c = clock->next;
 
-		actor->shminfo.readOnly = True;
-		if (!XShmAttach(display, &actor->shminfo)) {
-			SDL_SetError("Failed to attach shared memory image");
-			XDestroyImage(image);
-			shmdt(actor->shminfo.shmaddr);
-			shmctl(actor->shminfo.shmid, IPC_RMID, 0);
-			goto cleanup_window;
-		}
+	XDestroyWindow(display, clock->fence);
+	free(clock);
+
+	/* Nobody will end the frame; commits go out right away again. */
+	if (!clocks) in_frame = False;
+}
 
-		/* Ensure attachment is done */
-		XSync(display, False);
+/** Changes a property of a fence window, for the server to tell us back
+  * once it gets there. The window is never mapped, so any atom will do. */
+static void frame_fence_send(Display *dpy, Window fence)
+{
+	XChangeProperty(dpy, fence, XA_WM_NAME, XA_STRING, 8,
+		PropModeAppend, NULL, 0);
+	XFlush(dpy);
+}
 
-		/* Nobody else needs it now */
-		shmctl(actor->shminfo.shmid, IPC_RMID, 0);
+/** Call for every PropertyNotify event.
+  * @return True if it was the fence of a frame clock. */
+static Bool frame_fence_returned(Window window)
+{
+	HAA_FrameClock *clock;
 
-		pixels = actor->shminfo.shmaddr;
-		image->data = (char*) pixels;
-	} else {
-		pixels = malloc(width * height * (vinfo.depth / 8));
-		if (!pixels) {
-			SDL_SetError("Cannot allocate image");
-			goto cleanup_window;
-		}
-		image = actor->image = XCreateImage(display, vinfo.visual,
-			vinfo.depth, ZPixmap, 0, (char*) pixels, width, height, 8, 0);
-		if (!image) {
-			SDL_SetError("Cannot create X image");
-			goto cleanup_window;
+	for (clock = clocks; clock; clock = clock->next) {
+		if (clock->fence == window) {
+			if (clock->fence_pending) {
+				clock->latency = SDL_GetTicks() - clock->fence_sent;
+				clock->fence_pending = False;
+				clock->fence_done = True;
+			}
+			return True;
 		}
 	}
 
-	/* Guess alpha mask */
-	Uint32 Amask = 0;
-	if (image->depth == 32) {
-		Amask = ~(vinfo.red_mask | vinfo.green_mask | vinfo.blue_mask);
-	}
+	return False;
+}
 
-	/* Create GC */
-	GC gc = actor->gc = XCreateGC(display, window, 0, NULL);
-	XSetForeground(display, gc, 0xFFFFFFFFU);
+int HAA_BeginFrame(HAA_FrameClock* clock)
+{
+	const Uint32 now = SDL_GetTicks();
 
-	/** Create SDL texture for actor */
-	actor->p.surface = SDL_CreateRGBSurfaceFrom(pixels,
-		image->width, image->height, image->depth, image->bytes_per_line,
-		vinfo.red_mask, vinfo.green_mask, vinfo.blue_mask, Amask);
+	if ((Sint32)(now - clock->next_frame) < 0) {
+		/* Too early; hold changes back until the next frame ends. */
+		in_frame = True;
+		return 0;
+	}
 
-	if (!actor->p.surface) {
-		/* SDL Error already set */
-		goto cleanup_gc;
+	/* Do not try to catch up on missed frames. */
+	clock->next_frame += clock->interval * (1 + clock->skip);
+	if ((Sint32)(now - clock->next_frame) > 0) {
+		clock->next_frame = now;
 	}
 
-	/* Map X11 window */
-	XSelectInput(display, window, PropertyChangeMask);
-	XMapWindow(display, window);
+	in_frame = True;
 
-	/* Add to actor linked list */
-	if (first == NULL) {
-		assert(last == NULL);
-		actor->next = actor->prev = NULL;
-		first = last = actor;
-	} else {
-		last->next = actor;
-		actor->prev = last;
-		actor->next = NULL;
-		last = actor;
-	}
+	return 1;
+}
 
-	XSync(display, False);
-	return (HAA_Actor*) actor;
+int HAA_EndFrame(HAA_FrameClock* clock)
+{
+	HAA_ActorPriv* a;
+	const Uint32 now = SDL_GetTicks();
+	Uint64 stat_start = stat_time();
 
-cleanup_gc:
-	XFreeGC(display, gc);
-cleanup_image:
-	if (have_shm) {
-		XShmDetach(display, &actor->shminfo);
-		XDestroyImage(image);
-		shmdt(actor->shminfo.shmaddr);
-	} else {
-		XDestroyImage(image);
+	in_frame = False;
+
+	for (a = first; a; a = a->next) {
+		unsigned long serial = track_begin();
+		HAA_Pending(a);
+		track_end(a, HAA_OP_COMMIT, serial);
 	}
-cleanup_window:
-	XDestroyWindow(display, window);
-	if (actor->colormap) XFreeColormap(display, actor->colormap);
-cleanup_actor:
-	free(actor);
+	groups_committed();
+	if (!submit_display) XFlush(display);
+	stat_latency(stats.commit_latency, stat_start);
 
-	XSync(display, True);
-	return NULL;
-}
-	
-void HAA_FreeActor(HAA_Actor* a)
-{
-	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
-	if (!a) return;
+	/* Rather than waiting for the server every frame, keep a single fence
+	 * in flight behind the frame requests and see how long it takes to
+	 * come back (as an event, read whenever the app pumps them). */
+	if (clock->fence_pending) {
+		if (!clock->fence_overdue && now - clock->fence_sent > clock->interval) {
+			/* Still not there after a whole frame. */
+			clock->fence_overdue = True;
+			if (clock->skip < MAX_FRAME_SKIP) clock->skip++;
+		}
+		return 0;
+	}
 
-	XFreeGC(display, actor->gc);
-	if (have_shm) {
-		XShmDetach(display, &actor->shminfo);
-		XDestroyImage(actor->image);
-		shmdt(actor->shminfo.shmaddr);
-		XDestroyWindow(display, actor->window);
-	} else {
-		XDestroyImage(actor->image);
+	if (clock->fence_done) {
+		clock->fence_done = False;
+		if (clock->fence_overdue) {
+			/* Already counted. */
+		} else if (clock->latency > clock->interval / 2) {
+			/* Lagging: give the server (and ourselves) some breathing room. */
+			if (clock->skip < MAX_FRAME_SKIP) clock->skip++;
+		} else if (clock->latency < clock->interval / 4 && clock->skip > 0) {
+			clock->skip--;
+		}
 	}
-	if (actor->colormap)
-		XFreeColormap(display, actor->colormap);
-	SDL_FreeSurface(actor->p.surface);
 
-	/* Remove actor from global linked list */
-	if (first == actor && last == actor) {
-		assert(!actor->next && !actor->prev);
-		first = NULL;
-		last = NULL;
-	} else if (last == actor) {
-		assert(!actor->next && actor->prev);
-		last = actor->prev;
-		last->next = NULL;
-	} else if (first == actor) {
-		assert(actor->next && !actor->prev);
-		first = actor->next;
-		first->prev = NULL;
+	clock->fence_sent = now;
+	clock->fence_pending = True;
+	clock->fence_overdue = False;
+	if (submit_display) {
+		/* Behind the requests of the submission thread. */
+		HAA_Command *cmd = submit_new(HAA_CMD_FENCE, NULL);
+		if (!cmd) {
+			clock->fence_pending = False;
+			return 0;
+		}
+		cmd->u.fence = clock->fence;
+		submit_post(cmd);
 	} else {
-		assert(actor->next && actor->prev);
-		actor->prev->next = actor->next;
-		actor->next->prev = actor->prev;
+		frame_fence_send(display, clock->fence);
 	}
 
-	free(actor);
+	return 0;
+}
 
-	XFlush(display);
+Uint32 HAA_GetFrameLatency(HAA_FrameClock* clock)
+{
+	return clock->latency;
 }
 
-int HAA_Commit(HAA_Actor* a)
+int HAA_GetStats(HAA_Actor* a, HAA_Stats* s)
 {
+#ifndef HAA_NO_STATS
 	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
 
-	HAA_Pending(actor);
-	XSync(display, False);
+	*s = actor->stats;
+	return 0;
+#else
+	(void)a;
+	memset(s, 0, sizeof(*s));
+	SDL_SetError("SDL_haa was built without statistics");
+	return -1;
+#endif
+}
 
+int HAA_GetGlobalStats(HAA_GlobalStats* s)
+{
+#ifndef HAA_NO_STATS
+	*s = stats;
 	return 0;
+#else
+	memset(s, 0, sizeof(*s));
+	SDL_SetError("SDL_haa was built without statistics");
+	return -1;
+#endif
 }
 
-int HAA_Flip(HAA_Actor* a)
+int HAA_StartTrace(const char *file)
 {
-	HAA_ActorPriv* actor = (HAA_ActorPriv*)a;
-	Window window = actor->window;
-	GC gc = actor->gc;
-	XImage *image = actor->image;
+	static const HAA_TraceHeader header = {
+		HAA_TRACE_MAGIC, HAA_TRACE_VERSION, HAA_TRACE_BYTE_ORDER
+	};
+	HAA_ActorPriv* a;
+	FILE *f;
 
-	if (have_shm) {
-		XShmPutImage(display, window, gc, image, 
-						0, 0, 0, 0, image->width, image->height, False);
-	} else {
-		XPutImage(display, window, gc, image, 
-					0, 0, 0, 0, image->width, image->height);
+	HAA_StopTrace();
+
+	f = fopen(file, "wb");
+	if (!f) {
+		SDL_SetError("Cannot open trace file '%s'", file);
+		return -1;
 	}
+	/* Records are small; do not hit the disk for each one. */
+	setvbuf(f, NULL, _IOFBF, 64 * 1024);
+	fwrite(&header, sizeof(header), 1, f);
 
-	HAA_Pending(actor);
-	XSync(display, False);
+	if (submit_lock) SDL_mutexP(submit_lock);
+	trace_file = f;
+	trace_last = monotonic_us();
+	if (submit_lock) SDL_mutexV(submit_lock);
+
+	/* So that the replay knows about actors created before now. */
+	for (a = first; a; a = a->next) {
+		trace_create(a);
+		trace_window(HAA_TRACE_MAP, a->window);
+	}
+	/* Pooled actors are unmapped, but may be handed out again later. */
+	for (a = pool_first; a; a = a->next) {
+		trace_create(a);
+	}
 
 	return 0;
 }
 
+void HAA_StopTrace(void)
+{
+	FILE *f;
+
+	if (submit_lock) SDL_mutexP(submit_lock);
+	f = trace_file;
+	trace_file = NULL;
+	if (submit_lock) SDL_mutexV(submit_lock);
+
+	if (f) fclose(f);
+}
@@ -60,6 +60,136 @@ typedef enum HAA_Actor_Pending {
 	HAA_PENDING_EVERYTHING		= 0xFFU
 } HAA_Actor_Pending;
 
+typedef enum HAA_Init_Flags {
+	/** Do not wait for the X server after every commit just to catch errors;
+	  * errors are recorded per actor instead (see HAA_GetError). */
+	HAA_INIT_ASYNC_ERRORS	= (1 << 0),
+	/** Send messages and images from a dedicated thread with its own
+	  * X connection. HAA_Commit, HAA_Flip, HAA_FlipRects, HAA_CommitAll and
+	  * HAA_FlipAll then never wait for the X server (unless a single
+	  * buffered actor has to) and may be called from any thread,
+	  * as long as each actor is only touched by one thread at a time.
+	  * Every other function must still be called from the thread that
+	  * handles SDL events. X errors caused by the dedicated thread are
+	  * ignored, and counters may lose some updates. */
+	HAA_INIT_THREADED		= (1 << 1)
+} HAA_Init_Flags;
+
+typedef enum HAA_Operation {
+	HAA_OP_NONE		= 0,
+	HAA_OP_CREATE	= 1,
+	HAA_OP_COMMIT	= 2,
+	HAA_OP_FLIP		= 3
+} HAA_Operation;
+
+/** An X error caused by a request made on behalf of an actor. */
+typedef struct HAA_Error {
+	/** The library call that caused the failing request. */
+	HAA_Operation operation;
+	unsigned char error_code, request_code, minor_code;
+	unsigned long serial;
+} HAA_Error;
+
+typedef enum HAA_Actor_Flags {
+	/** Use two shared memory images, swapping between them on every flip,
+	  * so that flips do not have to wait for the X server. */
+	HAA_ACTOR_DOUBLEBUF		= (1 << 0),
+	/** If the X server supports shared memory pixmaps, use one as the
+	  * window background, so that flips do not need to upload any pixels.
+	  * The server may read from the surface at any time (e.g. on exposes).
+	  * Such actors are never double buffered. If the server refuses to
+	  * create the pixmap, images are uploaded on every flip as usual. */
+	HAA_ACTOR_SHM_PIXMAP	= (1 << 1),
+	/** The surface is always 32 bpp ARGB (0xAARRGGBB), whatever the visual;
+	  * damaged regions are converted to the window format on every flip. */
+	HAA_ACTOR_FORMAT_ARGB8888	= (1 << 2),
+	/** The surface is always 16 bpp RGB565, whatever the visual. */
+	HAA_ACTOR_FORMAT_RGB565	= (1 << 3),
+	/** Use ordered dithering when converting ARGB8888 to a 16 bpp window. */
+	HAA_ACTOR_DITHER		= (1 << 4),
+	/** The surface has straight (not premultiplied) alpha; it is
+	  * premultiplied on every flip. */
+	HAA_ACTOR_PREMULTIPLY	= (1 << 5),
+	/** Keep a copy of the surface as last flipped, so that HAA_Flip and
+	  * HAA_FlipAll only upload the tiles that changed since. Costs a copy
+	  * of the surface in memory and a compare of it on every flip. */
+	HAA_ACTOR_AUTO_DAMAGE	= (1 << 6)
+} HAA_Actor_Flags;
+
+/** Actor properties that can be animated with a HAA_Timeline. */
+typedef enum HAA_Property {
+	HAA_PROPERTY_POSITION_X	= 0,
+	HAA_PROPERTY_POSITION_Y	= 1,
+	HAA_PROPERTY_DEPTH		= 2,
+	HAA_PROPERTY_SCALE_X	= 3,	/**< 16.16 fixed point */
+	HAA_PROPERTY_SCALE_Y	= 4,	/**< 16.16 fixed point */
+	HAA_PROPERTY_ROTATION_X	= 5,	/**< 16.16 fixed point degrees */
+	HAA_PROPERTY_ROTATION_Y	= 6,	/**< 16.16 fixed point degrees */
+	HAA_PROPERTY_ROTATION_Z	= 7,	/**< 16.16 fixed point degrees */
+	HAA_PROPERTY_OPACITY	= 8,
+	HAA_PROPERTY_ANCHOR_X	= 9,
+	HAA_PROPERTY_ANCHOR_Y	= 10
+} HAA_Property;
+
+/** How a property goes from one keyframe value to the next. */
+typedef enum HAA_Easing {
+	HAA_EASE_LINEAR			= 0,
+	HAA_EASE_IN_QUAD		= 1,
+	HAA_EASE_OUT_QUAD		= 2,
+	HAA_EASE_IN_OUT_QUAD	= 3,
+	HAA_EASE_IN_CUBIC		= 4,
+	HAA_EASE_OUT_CUBIC		= 5,
+	HAA_EASE_IN_OUT_CUBIC	= 6,
+	HAA_EASE_STEP			= 7	/**< Jump to the value at the keyframe time */
+} HAA_Easing;
+
+/** A set of keyframes animating the properties of one actor. */
+typedef struct HAA_Timeline HAA_Timeline;
+
+/** Kinds of messages sent to the compositor, for HAA_Stats. */
+typedef enum HAA_Message {
+	HAA_MESSAGE_SHOW		= 0,
+	HAA_MESSAGE_POSITION	= 1,
+	HAA_MESSAGE_ROTATION	= 2,
+	HAA_MESSAGE_SCALE		= 3,
+	HAA_MESSAGE_ANCHOR		= 4,
+	HAA_MESSAGE_PARENT		= 5,
+	HAA_MESSAGE_COUNT		= 6
+} HAA_Message;
+
+/** Performance counters of an actor. */
+typedef struct HAA_Stats {
+	Uint32 flips;
+	/** Pixel data sent through XShmPutImage/XPutImage. */
+	Uint64 bytes_uploaded;
+	Uint32 messages[HAA_MESSAGE_COUNT];
+} HAA_Stats;
+
+/** Bucket i counts calls that took less than 2^i microseconds
+  * (the last one counts everything slower). */
+#define HAA_LATENCY_BUCKETS 20
+
+/** Performance counters of the entire library. */
+typedef struct HAA_GlobalStats {
+	/** Totals for all actors, including already freed ones. */
+	HAA_Stats actors;
+	Uint32 syncs;
+	/** Time spent in XSync, in microseconds. */
+	Uint64 sync_time;
+	Uint32 reparents;
+	Uint32 compositor_restarts;
+	/** Shared memory currently allocated. */
+	Uint64 shm_bytes;
+	Uint32 flip_latency[HAA_LATENCY_BUCKETS];
+	Uint32 commit_latency[HAA_LATENCY_BUCKETS];
+} HAA_GlobalStats;
+
+/** A set of actors moved, scaled, turned and faded together. */
+typedef struct HAA_Group HAA_Group;
+
+/** Paces commits to a target frame rate. */
+typedef struct HAA_FrameClock HAA_FrameClock;
+
 /** A Hildon Animation Actor. */
 typedef struct HAA_Actor {
 	/** The associated SDL surface; you can render to it. */
@@ -75,7 +205,7 @@ typedef struct HAA_Actor {
 } HAA_Actor;
 
 /** Invoke after SDL_Init.
-	@param flags reserved for future expansion (pass 0)
+	@param flags a combination of HAA_Init_Flags (or 0).
 	@return 0 if SDL_haa was initialized correctly.
   */
 extern DECLSPEC int SDLCALL HAA_Init(Uint32 flags);
@@ -86,8 +216,14 @@ extern DECLSPEC void SDLCALL HAA_Quit();
 
 /** 
   Call before handling any SDL_Event (or use SDL_SetEventFilter).
+  After a compositor restart, the actors are mapped again from here once
+  the compositor had some time to settle. If SDL was initialized with
+  SDL_INIT_TIMER, a SDL_USEREVENT is pushed to wake up your event loop at
+  that point, which this function filters out; otherwise remapping waits
+  for the next event.
   @param event the SDL_Event you were about to handle.
-  @return 1 if the event was filtered and should not be handled by your app.
+  @return 0 if SDL_haa handled the event and your app should drop it,
+    or 1 if your app should handle it (as with SDL_SetEventFilter).
 */
 extern DECLSPEC int SDLCALL HAA_FilterEvent(const SDL_Event *event);
 
@@ -99,11 +235,15 @@ extern DECLSPEC int SDLCALL HAA_FilterEvent(const SDL_Event *event);
 extern DECLSPEC int SDLCALL HAA_SetVideoMode(void);
 
 /** Creates both an animation actor and its associated surface.
-  * @param flags reserved (pass 0)
+  * @param flags a combination of HAA_Actor_Flags (or 0).
+  * 	With HAA_ACTOR_DOUBLEBUF, surface->pixels changes on every flip and
+  * 	the contents of the new back buffer are those of two flips ago.
+  * 	With one of the HAA_ACTOR_FORMAT_* flags, surface->pixels never
+  * 	changes and keeps its contents.
   * @param width size of the actor surface
   * @param height
-  * @param bitsPerPixel depth of the actor surface
-  * 	a 32 bpp surface will have an alpha channel.
+  * @param bitsPerPixel depth of the actor surface (or of the window, with
+  * 	HAA_ACTOR_FORMAT_*); a 32 bpp surface will have an alpha channel.
   * @return the created HAA_Actor, or NULL if an error happened.
   */
 extern DECLSPEC HAA_Actor* SDLCALL HAA_CreateActor(Uint32 flags,
@@ -112,10 +252,103 @@ extern DECLSPEC HAA_Actor* SDLCALL HAA_CreateActor(Uint32 flags,
 /** Frees an animation actor and associated surface. */
 extern DECLSPEC void SDLCALL HAA_FreeActor(HAA_Actor* actor);
 
+/** Changes the size of an actor, keeping its window, so that the compositor
+  * does not have to set it up again. Images are reused when big enough, and
+  * otherwise grown with some room to spare.
+  * actor->surface is replaced by a new one, cleared.
+  * @return 0 if everything went OK; on failure, the actor is left as it was.
+  */
+extern DECLSPEC int SDLCALL HAA_ResizeActor(HAA_Actor* actor,
+	int width, int height);
+
+/** Makes HAA_FreeActor keep up to max_actors hidden actors (using at most
+  * max_bytes of image memory) around, so that later HAA_CreateActor calls
+  * with the same flags, size and depth can reuse them instead of creating
+  * new windows and images. Pass 0 to disable the pool (the default).
+  * @return 0 if everything went OK.
+  */
+extern DECLSPEC int SDLCALL HAA_SetActorPool(int max_actors, Uint32 max_bytes);
+
+/** Creates count actors with the given parameters straight into the pool.
+  * @return 0 if everything went OK, or -1 if they did not fit in the pool.
+  */
+extern DECLSPEC int SDLCALL HAA_PrewarmActors(int count, Uint32 flags,
+	int width, int height, int bitsPerPixel);
+
 /** Flushes any pending position, scale, orientation, etc. changes. */
 extern DECLSPEC int SDLCALL HAA_Commit(HAA_Actor* actor);
 /** Puts contents of actor surface to screen. */
 extern DECLSPEC int SDLCALL HAA_Flip(HAA_Actor* actor);
+/** Puts only the given areas of the actor surface to screen,
+  * like SDL_UpdateRects. Overlapping rectangles are merged before uploading.
+  * Also flushes any pending changes, like HAA_Flip.
+  */
+extern DECLSPEC int SDLCALL HAA_FlipRects(HAA_Actor* actor,
+	int numrects, const SDL_Rect *rects);
+
+/** Uploads the frames of an animation to the server once, so that
+  * HAA_SetFrame can show any of them without sending pixels again.
+  * The sheet holds frames of the actor size, left to right and top to
+  * bottom; frames are converted like HAA_Blit does, replacing whatever
+  * was on the surface. Replaces any previous frames; resizing the actor
+  * drops them.
+  * @return the number of frames, or -1 if an error happened.
+  */
+extern DECLSPEC int SDLCALL HAA_SetFrames(HAA_Actor* actor,
+	SDL_Surface *sheet);
+/** Shows one of the frames uploaded by HAA_SetFrames, with a copy done by
+  * the server, and flushes any pending changes, like HAA_Flip.
+  * The surface is not touched (except by HAA_ACTOR_SHM_PIXMAP actors,
+  * whose images are the window contents); a later flip puts it back.
+  */
+extern DECLSPEC int SDLCALL HAA_SetFrame(HAA_Actor* actor, int frame);
+
+/** Fills a rectangle of the actor surface (NULL for all of it) and marks
+  * it as damaged.
+  * @param color a pixel value in the surface format, as from SDL_MapRGBA.
+  */
+extern DECLSPEC int SDLCALL HAA_Fill(HAA_Actor* actor, const SDL_Rect *rect,
+	Uint32 color);
+/** Copies src (or the srcrect part of it; NULL for all) to (x, y) on the
+  * actor surface and marks that region as damaged.
+  * Surfaces in a different format than the actor, or with a colorkey or
+  * alpha blending enabled, go through SDL_BlitSurface, which honours them.
+  */
+extern DECLSPEC int SDLCALL HAA_Blit(HAA_Actor* actor, int x, int y,
+	SDL_Surface *src, const SDL_Rect *srcrect);
+/** Like HAA_Blit, but blends src over the surface using its alpha channel.
+  * Fast when src is 32 bpp ARGB (not premultiplied) and the actor surface
+  * is either 32 bpp xRGB/ARGB or 16 bpp RGB565; the surface alpha, if any,
+  * becomes a + surface_alpha * (1 - a). Anything else goes through
+  * SDL_BlitSurface.
+  */
+extern DECLSPEC int SDLCALL HAA_BlitAlpha(HAA_Actor* actor, int x, int y,
+	SDL_Surface *src, const SDL_Rect *srcrect);
+/** Marks a rectangle of the actor surface (NULL for all of it) as damaged,
+  * e.g. after drawing to it by other means. */
+extern DECLSPEC void SDLCALL HAA_AddDamage(HAA_Actor* actor,
+	const SDL_Rect *rect);
+/** Like HAA_FlipRects, with the regions damaged since the last flip. */
+extern DECLSPEC int SDLCALL HAA_FlipDamage(HAA_Actor* actor);
+
+/** Returns the first X error caused by an actor since it was created
+  * or HAA_ClearError was last called, or NULL if there was none.
+  * Only available if HAA_INIT_ASYNC_ERRORS was passed to HAA_Init;
+  * note errors are only noticed once the X server replies to a later request,
+  * e.g. while SDL is pumping events.
+  */
+extern DECLSPEC const HAA_Error* SDLCALL HAA_GetError(HAA_Actor* actor);
+/** Forgets about any previous error in this actor. */
+extern DECLSPEC void SDLCALL HAA_ClearError(HAA_Actor* actor);
+
+/** Returns 1 once the compositor has acknowledged the actor (as seen by
+  * HAA_FilterEvent), so that changes to it take effect; 0 until then. */
+extern DECLSPEC int SDLCALL HAA_IsReady(HAA_Actor* actor);
+
+/** Like HAA_Commit, but for every actor, with a single round trip. */
+extern DECLSPEC int SDLCALL HAA_CommitAll(void);
+/** Like HAA_Flip, but for every actor, with a single round trip. */
+extern DECLSPEC int SDLCALL HAA_FlipAll(void);
 
 static inline void HAA_Show
 (HAA_Actor* actor)
@@ -216,6 +449,117 @@ static inline void HAA_SetRotation
 	HAA_SetRotationX(actor, axis, degrees * (1 << 16), x, y, z);
 }
 
+/** Creates an (empty, stopped) timeline animating the given actor.
+  * Timelines whose actor is freed just stop.
+  */
+extern DECLSPEC HAA_Timeline* SDLCALL HAA_CreateTimeline(HAA_Actor* actor);
+extern DECLSPEC void SDLCALL HAA_FreeTimeline(HAA_Timeline* timeline);
+
+/** Adds a keyframe to a timeline.
+  * @param time in milliseconds since the timeline was started.
+  * @param value the property will have at that time, in the same units as
+  *  the HAA_Actor fields.
+  * @param easing used to get to this value from the previous keyframe
+  *  for the same property.
+  * @return 0 if everything went OK.
+  */
+extern DECLSPEC int SDLCALL HAA_AddKeyframe(HAA_Timeline* timeline,
+	HAA_Property property, Uint32 time, Sint32 value, HAA_Easing easing);
+
+/** Number of times a timeline plays once started; 0 for forever. Default 1. */
+extern DECLSPEC void SDLCALL HAA_SetTimelineLoops(HAA_Timeline* timeline,
+	int loops);
+
+extern DECLSPEC void SDLCALL HAA_StartTimeline(HAA_Timeline* timeline);
+extern DECLSPEC void SDLCALL HAA_StopTimeline(HAA_Timeline* timeline);
+
+/** Updates every running timeline to the current time and sends the
+  * changes, at most once per actor, with a single round trip.
+  * Call once per frame (e.g. from your main loop or a timer event).
+  * @return number of timelines still running.
+  */
+extern DECLSPEC int SDLCALL HAA_Animate(void);
+
+/** Creates an empty group, at the origin and otherwise untransformed. */
+extern DECLSPEC HAA_Group* SDLCALL HAA_CreateGroup(void);
+/** Frees a group; its actors stay, with their properties no longer
+  * relative to it (from their next commit on). */
+extern DECLSPEC void SDLCALL HAA_FreeGroup(HAA_Group* group);
+
+/** Returns the transform of a group, to be changed with HAA_SetPosition,
+  * HAA_SetDepth, HAA_SetScale, HAA_SetRotation (Z axis only; the center is
+  * ignored), HAA_SetAnchor, HAA_Show, HAA_Hide and HAA_SetOpacity.
+  * The group position is where its anchor point goes; the group turns and
+  * scales around that point. Groups have no size, so gravity is ignored.
+  * Never pass it to any other function.
+  */
+extern DECLSPEC HAA_Actor* SDLCALL HAA_GetGroupTransform(HAA_Group* group);
+
+/** Puts an actor in a group (taking it out of any other one).
+  * From then on, its position, depth, scale, Z rotation and opacity are
+  * relative to the group, and it turns around its own anchor point;
+  * the center of its Z rotation is ignored. X and Y rotations stay as they
+  * are. Scaling a group unevenly does not skew turned actors.
+  * @return 0 if everything went OK.
+  */
+extern DECLSPEC int SDLCALL HAA_AddToGroup(HAA_Group* group, HAA_Actor* actor);
+/** Takes an actor out of its group, if any; its properties are no longer
+  * relative to it. Freeing an actor does it too. */
+extern DECLSPEC void SDLCALL HAA_RemoveFromGroup(HAA_Actor* actor);
+
+/** Like HAA_Commit, for every actor in a group at once, with a single round
+  * trip; only the properties whose composed values changed are sent.
+  * HAA_CommitAll and HAA_EndFrame send group changes too.
+  */
+extern DECLSPEC int SDLCALL HAA_CommitGroup(HAA_Group* group);
+
+/** Creates a frame clock targeting the given frames per second. */
+extern DECLSPEC HAA_FrameClock* SDLCALL HAA_CreateFrameClock(int fps);
+extern DECLSPEC void SDLCALL HAA_FreeFrameClock(HAA_FrameClock* clock);
+
+/** Call before drawing a frame.
+  * Between HAA_BeginFrame and HAA_EndFrame, HAA_Commit, HAA_CommitAll,
+  * HAA_CommitGroup and HAA_Animate do not send anything, and flips only send
+  * pixels; all other changes are sent by HAA_EndFrame.
+  * @return 1 if a frame should be drawn now, or 0 if it is too early
+  *  (e.g. because the compositor is lagging behind); in that case do not
+  *  call HAA_EndFrame. Changes done meanwhile, commits included, are held
+  *  back and merged into the next frame; freeing the last clock sends them
+  *  with the next commit instead.
+  */
+extern DECLSPEC int SDLCALL HAA_BeginFrame(HAA_FrameClock* clock);
+
+/** Sends every pending change of every actor, without waiting for the
+  * X server. Instead, the clock keeps track of how long the server takes
+  * to get through a frame (as seen by HAA_FilterEvent), and if it lags
+  * behind, drops some of the next frames.
+  * @return 0 if everything went OK.
+  */
+extern DECLSPEC int SDLCALL HAA_EndFrame(HAA_FrameClock* clock);
+
+/** How long the X server took to get through the last measured frame,
+  * in ms. */
+extern DECLSPEC Uint32 SDLCALL HAA_GetFrameLatency(HAA_FrameClock* clock);
+
+/** Copies the performance counters of an actor.
+  * @return 0, or -1 if SDL_haa was built with HAA_NO_STATS.
+  */
+extern DECLSPEC int SDLCALL HAA_GetStats(HAA_Actor* actor, HAA_Stats* stats);
+/** Copies the global performance counters.
+  * @return 0, or -1 if SDL_haa was built with HAA_NO_STATS.
+  */
+extern DECLSPEC int SDLCALL HAA_GetGlobalStats(HAA_GlobalStats* stats);
+
+/** Starts recording every message, image upload and sync sent to the X
+  * server into a binary trace file, which test/replay can play back.
+  * Setting the SDL_HAA_TRACE environment variable to a file name
+  * makes HAA_Init start a trace there.
+  * @return 0 if the file could be created, -1 otherwise.
+  */
+extern DECLSPEC int SDLCALL HAA_StartTrace(const char *file);
+/** Stops recording and closes the trace file, if any. */
+extern DECLSPEC void SDLCALL HAA_StopTrace(void);
+
 /* Ends C function definitions when using C++ */
 #ifdef __cplusplus
 }
@@ -0,0 +1,454 @@
+/* This file is part of SDL_haa - SDL addon for Hildon Animation Actors
+ * Copyright (C) 2010 Javier S. Pedro
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA or see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+#include "SDL_haa_pixels.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/** 4x4 ordered dither matrix. */
+static const Uint8 bayer[4][4] = {
+	{  0,  8,  2, 10 },
+	{ 12,  4, 14,  6 },
+	{  3, 11,  1,  9 },
+	{ 15,  7, 13,  5 }
+};
+
+/** What to add to each channel of the pixel at (x, y) before dropping
+  * 3 bits of red and blue and 2 bits of green, laid out like a pixel. */
+static Uint32 dither_word(int x, int y)
+{
+	const Uint32 d = bayer[y & 3][x & 3];
+	return ((d >> 1) << 16) | ((d >> 2) << 8) | (d >> 1);
+}
+
+static inline Uint16 pack_565(Uint32 p)
+{
+	return ((p >> 8) & 0xF800) | ((p >> 5) & 0x07E0) | ((p >> 3) & 0x001F);
+}
+
+/** Adds two pixels channel by channel, saturating; alpha is kept. */
+static inline Uint32 add_saturate(Uint32 p, Uint32 d)
+{
+	Uint32 r = ((p >> 16) & 0xFF) + ((d >> 16) & 0xFF);
+	Uint32 g = ((p >> 8) & 0xFF) + ((d >> 8) & 0xFF);
+	Uint32 b = (p & 0xFF) + (d & 0xFF);
+
+	if (r > 0xFF) r = 0xFF;
+	if (g > 0xFF) g = 0xFF;
+	if (b > 0xFF) b = 0xFF;
+
+	return (p & 0xFF000000) | (r << 16) | (g << 8) | b;
+}
+
+static inline Uint32 unpack_565(Uint16 p)
+{
+	Uint32 r = (p >> 11) & 0x1F, g = (p >> 5) & 0x3F, b = p & 0x1F;
+
+	r = (r << 3) | (r >> 2);
+	g = (g << 2) | (g >> 4);
+	b = (b << 3) | (b >> 2);
+
+	return 0xFF000000 | (r << 16) | (g << 8) | b;
+}
+
+/** c * a / 255, rounded. */
+static inline Uint32 mul_255(Uint32 c, Uint32 a)
+{
+	Uint32 t = c * a + 128;
+	return (t + (t >> 8)) >> 8;
+}
+
+static inline Uint32 premultiply(Uint32 p)
+{
+	const Uint32 a = p >> 24;
+
+	return (p & 0xFF000000) |
+		(mul_255((p >> 16) & 0xFF, a) << 16) |
+		(mul_255((p >> 8) & 0xFF, a) << 8) |
+		mul_255(p & 0xFF, a);
+}
+
+/** s * a + d * (255 - a), divided by 255 and rounded. */
+static inline Uint32 mix_255(Uint32 s, Uint32 d, Uint32 a)
+{
+	Uint32 t = s * a + d * (255 - a) + 128;
+	return (t + (t >> 8)) >> 8;
+}
+
+static inline Uint32 blend(Uint32 s, Uint32 d)
+{
+	const Uint32 a = s >> 24;
+
+	/* Mixing 255 into the alpha channel gives a + da * (1 - a). */
+	return (mix_255(0xFF, d >> 24, a) << 24) |
+		(mix_255((s >> 16) & 0xFF, (d >> 16) & 0xFF, a) << 16) |
+		(mix_255((s >> 8) & 0xFF, (d >> 8) & 0xFF, a) << 8) |
+		mix_255(s & 0xFF, d & 0xFF, a);
+}
+
+#if defined(__SSE2__)
+/** Four pixels to 565, one per (sign extended) 32 bit lane. */
+static inline __m128i pack_565_sse2(__m128i p)
+{
+	__m128i r = _mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0xF800));
+	__m128i g = _mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x07E0));
+	__m128i b = _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x001F));
+	__m128i v = _mm_or_si128(_mm_or_si128(r, g), b);
+
+	/* So that the signed saturating pack keeps all 16 bits. */
+	return _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+}
+
+/** Four 565 pixels, zero extended to 32 bit lanes, to 8888. */
+static inline __m128i unpack_565_sse2(__m128i p)
+{
+	const __m128i mask5 = _mm_set1_epi32(0x1F), mask6 = _mm_set1_epi32(0x3F);
+	__m128i r = _mm_and_si128(_mm_srli_epi32(p, 11), mask5);
+	__m128i g = _mm_and_si128(_mm_srli_epi32(p, 5), mask6);
+	__m128i b = _mm_and_si128(p, mask5);
+
+	r = _mm_or_si128(_mm_slli_epi32(r, 3), _mm_srli_epi32(r, 2));
+	g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 4));
+	b = _mm_or_si128(_mm_slli_epi32(b, 3), _mm_srli_epi32(b, 2));
+
+	return _mm_or_si128(_mm_set1_epi32(0xFF000000),
+		_mm_or_si128(_mm_slli_epi32(r, 16),
+			_mm_or_si128(_mm_slli_epi32(g, 8), b)));
+}
+
+/** Two pixels, one channel per 16 bit lane, times their alpha / 255. */
+static inline __m128i premultiply_sse2(__m128i p)
+{
+	__m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(p,
+		_MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(p, a), _mm_set1_epi16(128));
+
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+/** Two pixels of each, one channel per 16 bit lane; see blend(). */
+static inline __m128i mix_sse2(__m128i s, __m128i d, __m128i a)
+{
+	__m128i ia = _mm_xor_si128(a, _mm_set1_epi16(0xFF));
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, ia));
+
+	t = _mm_add_epi16(t, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+/** Four pixels of each; see blend(). */
+static inline __m128i blend_sse2(__m128i s, __m128i d)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha = _mm_set1_epi32(0xFF000000);
+	__m128i so = _mm_or_si128(s, alpha);
+	__m128i a, lo, hi;
+
+	a = _mm_unpacklo_epi8(s, zero);
+	a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(a,
+		_MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	lo = mix_sse2(_mm_unpacklo_epi8(so, zero), _mm_unpacklo_epi8(d, zero), a);
+
+	a = _mm_unpackhi_epi8(s, zero);
+	a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(a,
+		_MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+	hi = mix_sse2(_mm_unpackhi_epi8(so, zero), _mm_unpackhi_epi8(d, zero), a);
+
+	return _mm_packus_epi16(lo, hi);
+}
+
+/** Blends four pixels over d, skipping the work if all are transparent
+  * or opaque. */
+static inline __m128i blend_over_sse2(__m128i s, __m128i d)
+{
+	const __m128i alpha = _mm_set1_epi32(0xFF000000);
+	__m128i sa = _mm_and_si128(s, alpha);
+
+	if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa, alpha)) == 0xFFFF) {
+		return s;
+	} else if (_mm_movemask_epi8(_mm_cmpeq_epi32(sa,
+			_mm_setzero_si128())) == 0xFFFF) {
+		return d;
+	}
+	return blend_sse2(s, d);
+}
+#elif defined(__ARM_NEON__)
+/** One channel of eight pixels; see blend(). */
+static inline uint8x8_t mix_neon(uint8x8_t s, uint8x8_t d, uint8x8_t a)
+{
+	uint16x8_t t = vmull_u8(s, a);
+	t = vmlal_u8(t, d, vmvn_u8(a));
+	return vraddhn_u16(t, vrshrq_n_u16(t, 8));
+}
+
+/** Eight 565 pixels, split into 8 bit channels. */
+static inline uint8x8x3_t unpack_565_neon(uint16x8_t v)
+{
+	uint8x8x3_t p;
+	p.val[2] = vshrn_n_u16(v, 8);
+	p.val[2] = vsri_n_u8(p.val[2], p.val[2], 5);
+	p.val[1] = vshrn_n_u16(v, 3);
+	p.val[1] = vsri_n_u8(p.val[1], p.val[1], 6);
+	p.val[0] = vmovn_u16(vshlq_n_u16(v, 3));
+	p.val[0] = vsri_n_u8(p.val[0], p.val[0], 5);
+	return p;
+}
+
+static inline uint16x8_t pack_565_neon(uint8x8_t r, uint8x8_t g, uint8x8_t b)
+{
+	uint16x8_t v = vshll_n_u8(r, 8);
+	v = vsriq_n_u16(v, vshll_n_u8(g, 8), 5);
+	return vsriq_n_u16(v, vshll_n_u8(b, 8), 11);
+}
+#endif
+
+void HAA_ConvertRow_8888_565(const Uint32 *src, Uint16 *dst, int n)
+{
+#if defined(__SSE2__)
+	for (; n >= 8; n -= 8, src += 8, dst += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *) src);
+		__m128i b = _mm_loadu_si128((const __m128i *) (src + 4));
+		_mm_storeu_si128((__m128i *) dst,
+			_mm_packs_epi32(pack_565_sse2(a), pack_565_sse2(b)));
+	}
+#elif defined(__ARM_NEON__)
+	for (; n >= 8; n -= 8, src += 8, dst += 8) {
+		uint8x8x4_t p = vld4_u8((const uint8_t *) src);
+		vst1q_u16(dst, pack_565_neon(p.val[2], p.val[1], p.val[0]));
+	}
+#endif
+	for (; n > 0; n--) {
+		*dst++ = pack_565(*src++);
+	}
+}
+
+void HAA_ConvertRow_8888_565_Dither(const Uint32 *src, Uint16 *dst,
+	int n, int x, int y)
+{
+#if defined(__SSE2__)
+	/* The pattern repeats every four pixels. */
+	const __m128i d = _mm_setr_epi32(dither_word(x, y),
+		dither_word(x + 1, y), dither_word(x + 2, y), dither_word(x + 3, y));
+	for (; n >= 8; n -= 8, x += 8, src += 8, dst += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *) src);
+		__m128i b = _mm_loadu_si128((const __m128i *) (src + 4));
+		a = _mm_adds_epu8(a, d);
+		b = _mm_adds_epu8(b, d);
+		_mm_storeu_si128((__m128i *) dst,
+			_mm_packs_epi32(pack_565_sse2(a), pack_565_sse2(b)));
+	}
+#elif defined(__ARM_NEON__)
+	uint8_t d5[8], d6[8];
+	int i;
+	for (i = 0; i < 8; i++) {
+		d5[i] = bayer[y & 3][(x + i) & 3] >> 1;
+		d6[i] = bayer[y & 3][(x + i) & 3] >> 2;
+	}
+	const uint8x8_t dither5 = vld1_u8(d5), dither6 = vld1_u8(d6);
+	for (; n >= 8; n -= 8, x += 8, src += 8, dst += 8) {
+		uint8x8x4_t p = vld4_u8((const uint8_t *) src);
+		p.val[0] = vqadd_u8(p.val[0], dither5);
+		p.val[1] = vqadd_u8(p.val[1], dither6);
+		p.val[2] = vqadd_u8(p.val[2], dither5);
+		vst1q_u16(dst, pack_565_neon(p.val[2], p.val[1], p.val[0]));
+	}
+#endif
+	for (; n > 0; n--, x++) {
+		*dst++ = pack_565(add_saturate(*src++, dither_word(x, y)));
+	}
+}
+
+void HAA_ConvertRow_565_8888(const Uint16 *src, Uint32 *dst, int n)
+{
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	for (; n >= 8; n -= 8, src += 8, dst += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *) src);
+		_mm_storeu_si128((__m128i *) dst,
+			unpack_565_sse2(_mm_unpacklo_epi16(v, zero)));
+		_mm_storeu_si128((__m128i *) (dst + 4),
+			unpack_565_sse2(_mm_unpackhi_epi16(v, zero)));
+	}
+#elif defined(__ARM_NEON__)
+	for (; n >= 8; n -= 8, src += 8, dst += 8) {
+		uint8x8x3_t c = unpack_565_neon(vld1q_u16(src));
+		uint8x8x4_t p;
+		p.val[0] = c.val[0];
+		p.val[1] = c.val[1];
+		p.val[2] = c.val[2];
+		p.val[3] = vdup_n_u8(0xFF);
+		vst4_u8((uint8_t *) dst, p);
+	}
+#endif
+	for (; n > 0; n--) {
+		*dst++ = unpack_565(*src++);
+	}
+}
+
+void HAA_ConvertRow_Premultiply(const Uint32 *src, Uint32 *dst, int n)
+{
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha = _mm_set1_epi32(0xFF000000);
+	for (; n >= 4; n -= 4, src += 4, dst += 4) {
+		__m128i p = _mm_loadu_si128((const __m128i *) src);
+		__m128i lo = premultiply_sse2(_mm_unpacklo_epi8(p, zero));
+		__m128i hi = premultiply_sse2(_mm_unpackhi_epi8(p, zero));
+		__m128i r = _mm_packus_epi16(lo, hi);
+		/* Alpha itself stays as it was. */
+		r = _mm_or_si128(_mm_andnot_si128(alpha, r), _mm_and_si128(alpha, p));
+		_mm_storeu_si128((__m128i *) dst, r);
+	}
+#elif defined(__ARM_NEON__)
+	for (; n >= 8; n -= 8, src += 8, dst += 8) {
+		uint8x8x4_t p = vld4_u8((const uint8_t *) src);
+		int c;
+		for (c = 0; c < 3; c++) {
+			uint16x8_t t = vmull_u8(p.val[c], p.val[3]);
+			p.val[c] = vraddhn_u16(t, vrshrq_n_u16(t, 8));
+		}
+		vst4_u8((uint8_t *) dst, p);
+	}
+#endif
+	for (; n > 0; n--) {
+		*dst++ = premultiply(*src++);
+	}
+}
+
+void HAA_FillRow_32(Uint32 *dst, Uint32 color, int n)
+{
+#if defined(__SSE2__)
+	const __m128i c = _mm_set1_epi32(color);
+	for (; n > 0 && ((uintptr_t) dst & 15); n--) {
+		*dst++ = color;
+	}
+	for (; n >= 4; n -= 4, dst += 4) {
+		_mm_store_si128((__m128i *) dst, c);
+	}
+#elif defined(__ARM_NEON__)
+	const uint32x4_t c = vdupq_n_u32(color);
+	for (; n >= 4; n -= 4, dst += 4) {
+		vst1q_u32(dst, c);
+	}
+#endif
+	for (; n > 0; n--) {
+		*dst++ = color;
+	}
+}
+
+void HAA_FillRow_16(Uint16 *dst, Uint16 color, int n)
+{
+#if defined(__SSE2__)
+	const __m128i c = _mm_set1_epi16(color);
+	for (; n > 0 && ((uintptr_t) dst & 15); n--) {
+		*dst++ = color;
+	}
+	for (; n >= 8; n -= 8, dst += 8) {
+		_mm_store_si128((__m128i *) dst, c);
+	}
+#elif defined(__ARM_NEON__)
+	const uint16x8_t c = vdupq_n_u16(color);
+	for (; n >= 8; n -= 8, dst += 8) {
+		vst1q_u16(dst, c);
+	}
+#endif
+	for (; n > 0; n--) {
+		*dst++ = color;
+	}
+}
+
+void HAA_BlendRow_8888_8888(const Uint32 *src, Uint32 *dst, int n)
+{
+#if defined(__SSE2__)
+	for (; n >= 4; n -= 4, src += 4, dst += 4) {
+		__m128i s = _mm_loadu_si128((const __m128i *) src);
+		__m128i d = _mm_loadu_si128((const __m128i *) dst);
+		_mm_storeu_si128((__m128i *) dst, blend_over_sse2(s, d));
+	}
+#elif defined(__ARM_NEON__)
+	for (; n >= 8; n -= 8, src += 8, dst += 8) {
+		uint8x8x4_t s = vld4_u8((const uint8_t *) src);
+		uint8x8x4_t d = vld4_u8((const uint8_t *) dst);
+		const uint8x8_t a = s.val[3];
+		d.val[0] = mix_neon(s.val[0], d.val[0], a);
+		d.val[1] = mix_neon(s.val[1], d.val[1], a);
+		d.val[2] = mix_neon(s.val[2], d.val[2], a);
+		d.val[3] = mix_neon(vdup_n_u8(0xFF), d.val[3], a);
+		vst4_u8((uint8_t *) dst, d);
+	}
+#endif
+	for (; n > 0; n--, src++, dst++) {
+		*dst = blend(*src, *dst);
+	}
+}
+
+void HAA_BlendRow_8888_565(const Uint32 *src, Uint16 *dst, int n)
+{
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	for (; n >= 8; n -= 8, src += 8, dst += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *) dst);
+		__m128i a = blend_over_sse2(_mm_loadu_si128((const __m128i *) src),
+			unpack_565_sse2(_mm_unpacklo_epi16(v, zero)));
+		__m128i b = blend_over_sse2(_mm_loadu_si128((const __m128i *) (src + 4)),
+			unpack_565_sse2(_mm_unpackhi_epi16(v, zero)));
+		_mm_storeu_si128((__m128i *) dst,
+			_mm_packs_epi32(pack_565_sse2(a), pack_565_sse2(b)));
+	}
+#elif defined(__ARM_NEON__)
+	for (; n >= 8; n -= 8, src += 8, dst += 8) {
+		uint8x8x4_t s = vld4_u8((const uint8_t *) src);
+		uint8x8x3_t d = unpack_565_neon(vld1q_u16(dst));
+		const uint8x8_t a = s.val[3];
+		vst1q_u16(dst, pack_565_neon(mix_neon(s.val[2], d.val[2], a),
+			mix_neon(s.val[1], d.val[1], a), mix_neon(s.val[0], d.val[0], a)));
+	}
+#endif
+	for (; n > 0; n--, src++, dst++) {
+		*dst = pack_565(blend(*src, unpack_565(*dst)));
+	}
+}
+
+int HAA_RowsDiffer(const Uint8 *a, const Uint8 *b, int n)
+{
+#if defined(__SSE2__)
+	for (; n >= 16; n -= 16, a += 16, b += 16) {
+		__m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) a),
+			_mm_loadu_si128((const __m128i *) b));
+		if (_mm_movemask_epi8(eq) != 0xFFFF) return 1;
+	}
+#elif defined(__ARM_NEON__)
+	for (; n >= 16; n -= 16, a += 16, b += 16) {
+		uint8x16_t x = veorq_u8(vld1q_u8(a), vld1q_u8(b));
+		uint64x1_t r = vreinterpret_u64_u8(vorr_u8(vget_low_u8(x),
+			vget_high_u8(x)));
+		if (vget_lane_u64(r, 0)) return 1;
+	}
+#endif
+	for (; n > 0; n--) {
+		if (*a++ != *b++) return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,60 @@
+/* This file is part of SDL_haa - SDL addon for Hildon Animation Actors
+ * Copyright (C) 2010 Javier S. Pedro
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA or see <http://www.gnu.org/licenses/>.
+ */
+
+/* Pixel kernels, with SSE2 and NEON versions. Not installed.
+ * ARGB8888 means 0xAARRGGBB words; RGB565 means 0xRRRRRGGGGGGBBBBB. */
+
+#ifndef __SDL_HAA_PIXELS_H
+#define __SDL_HAA_PIXELS_H
+
+#include "SDL.h"
+
+/** Not part of the library ABI. */
+#define HAA_INTERNAL __attribute__((visibility("hidden")))
+
+/** Converts a row of n pixels. */
+HAA_INTERNAL void HAA_ConvertRow_8888_565(const Uint32 *src, Uint16 *dst,
+	int n);
+/** Same, with 4x4 ordered dithering; x and y are the position of the
+  * first pixel on the surface. */
+HAA_INTERNAL void HAA_ConvertRow_8888_565_Dither(const Uint32 *src,
+	Uint16 *dst, int n, int x, int y);
+/** Converts a row of n pixels; alpha is set to opaque. */
+HAA_INTERNAL void HAA_ConvertRow_565_8888(const Uint16 *src, Uint32 *dst,
+	int n);
+/** Converts a row of n pixels from straight to premultiplied alpha. */
+HAA_INTERNAL void HAA_ConvertRow_Premultiply(const Uint32 *src, Uint32 *dst,
+	int n);
+
+/** Fills a row of n pixels with a color. */
+HAA_INTERNAL void HAA_FillRow_32(Uint32 *dst, Uint32 color, int n);
+HAA_INTERNAL void HAA_FillRow_16(Uint16 *dst, Uint16 color, int n);
+/** Blends a row of n ARGB8888 pixels with straight alpha over another row.
+  * Color channels are mixed by the source alpha; the destination alpha
+  * becomes a + da * (1 - a). */
+HAA_INTERNAL void HAA_BlendRow_8888_8888(const Uint32 *src, Uint32 *dst,
+	int n);
+/** Same, over a row of RGB565 pixels. */
+HAA_INTERNAL void HAA_BlendRow_8888_565(const Uint32 *src, Uint16 *dst,
+	int n);
+
+/** Whether two rows of n bytes differ. */
+HAA_INTERNAL int HAA_RowsDiffer(const Uint8 *a, const Uint8 *b, int n);
+
+#endif
@@ -0,0 +1,120 @@
+/* This file is part of SDL_haa - SDL addon for Hildon Animation Actors
+ * Copyright (C) 2010 Javier S. Pedro
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA or see <http://www.gnu.org/licenses/>.
+ */
+
+/* Format of the protocol trace files written by HAA_StartTrace.
+ * Not installed; shared only with the replay tool.
+ *
+ * A trace is a HAA_TraceHeader followed by records. Every record starts
+ * with a HAA_TraceRecordHeader and is followed by the payload for its type.
+ * Everything is stored in the byte order of the machine that wrote it.
+ */
+
+#ifndef __SDL_HAA_TRACE_H
+#define __SDL_HAA_TRACE_H
+
+#include <stdint.h>
+
+#define HAA_TRACE_MAGIC "HAAT"
+/** Bumped whenever records, fields or upload modes are added, so that an
+  * older replay refuses traces it would misreport.
+  * 1: first version.
+  * 2: HAA_TRACE_RESIZE records and HAA_TRACE_UPLOAD_COPY uploads. */
+#define HAA_TRACE_VERSION 2
+/** Reads back as something else if the byte order does not match. */
+#define HAA_TRACE_BYTE_ORDER 0x0102
+
+typedef struct HAA_TraceHeader {
+	char magic[4];
+	uint16_t version;
+	uint16_t byte_order;
+} HAA_TraceHeader;
+
+typedef enum HAA_TraceType {
+	HAA_TRACE_CREATE = 1,
+	HAA_TRACE_DESTROY,
+	HAA_TRACE_MAP,
+	HAA_TRACE_UNMAP,
+	HAA_TRACE_MESSAGE,
+	HAA_TRACE_UPLOAD,
+	HAA_TRACE_SYNC,
+	HAA_TRACE_RESIZE
+} HAA_TraceType;
+
+typedef struct HAA_TraceRecordHeader {
+	uint8_t type;
+	/** Size of the payload that follows, so unknown records can be skipped. */
+	uint8_t size;
+	uint16_t reserved;
+	/** Microseconds since the previous record (monotonic clock). */
+	uint32_t delta;
+} HAA_TraceRecordHeader;
+
+/** An actor window was created. */
+typedef struct HAA_TraceCreate {
+	uint32_t window;
+	uint16_t width, height;
+	uint8_t bpp;
+	uint8_t reserved[3];
+} HAA_TraceCreate;
+
+/** An actor window changed size. */
+typedef struct HAA_TraceResize {
+	uint32_t window;
+	uint16_t width, height;
+} HAA_TraceResize;
+
+/** Payload of HAA_TRACE_DESTROY, HAA_TRACE_MAP and HAA_TRACE_UNMAP. */
+typedef struct HAA_TraceWindow {
+	uint32_t window;
+} HAA_TraceWindow;
+
+/** A ClientMessage sent to the compositor. */
+typedef struct HAA_TraceMessage {
+	uint32_t window;
+	/** One of HAA_Message. */
+	uint8_t message;
+	uint8_t reserved[3];
+	int32_t data[5];
+} HAA_TraceMessage;
+
+typedef enum HAA_TraceUploadMode {
+	HAA_TRACE_UPLOAD_PUT,
+	HAA_TRACE_UPLOAD_SHM,
+	/** Repaint from a shared memory pixmap; no pixels sent. */
+	HAA_TRACE_UPLOAD_CLEAR,
+	/** Copy of a frame already on the server (HAA_SetFrame). */
+	HAA_TRACE_UPLOAD_COPY
+} HAA_TraceUploadMode;
+
+/** A region of an actor image was sent to the server. */
+typedef struct HAA_TraceUpload {
+	uint32_t window;
+	uint16_t x, y, w, h;
+	uint8_t mode;
+	uint8_t bpp;
+	uint8_t reserved[2];
+} HAA_TraceUpload;
+
+/** The library waited for the server to process all requests. */
+typedef struct HAA_TraceSync {
+	/** How long it took, in microseconds. */
+	uint32_t duration;
+} HAA_TraceSync;
+
+#endif
@@ -52,11 +52,11 @@ int main()
 	actor = HAA_CreateActor(SDL_SWSURFACE, 200, 200, 32);
 	assert(actor);
 
-	SDL_FillRect(actor->surface, NULL,
+	HAA_Fill(actor, NULL,
 		SDL_MapRGBA(actor->surface->format, 0, 255, 0, 250));
 
 	SDL_Rect hole = {63, 63, 74, 74};
-	SDL_FillRect(actor->surface, &hole,
+	HAA_Fill(actor, &hole,
 		SDL_MapRGBA(actor->surface->format, 0, 0, 255, 80));
 
 	HAA_SetPosition(actor, 400, 160);
@@ -0,0 +1,323 @@
+/* benchmark - measures SDL_haa performance, writing the results as JSON
+ *
+ * Meant to be run against the stubwm stand-in compositor (see "make bench"),
+ * but it will also work with the real hildon-desktop.
+ *
+ * This file is in the public domain, furnished "as is", without technical
+ * support, and with no warranty, express or implied, as to its usefulness for
+ * any purpose.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <sys/time.h>
+
+#include <SDL.h>
+#include <SDL_haa.h>
+
+static SDL_Surface *screen;
+
+static FILE *out;
+
+/** Time in microseconds. */
+static Uint64 now_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (Uint64) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/** Lets SDL_haa process the events that arrived so far. */
+static void pump_events(void)
+{
+	SDL_Event event;
+
+	while (SDL_PollEvent(&event)) {
+		HAA_FilterEvent(&event);
+	}
+}
+
+/** Counts how many of the given actors the compositor has acknowledged. */
+static int count_ready(HAA_Actor **actors, int count)
+{
+	int i, ready = 0;
+
+	for (i = 0; i < count; i++) {
+		if (HAA_IsReady(actors[i])) ready++;
+	}
+
+	return ready;
+}
+
+/** Lets SDL_haa process events until the given actors become ready. */
+static int wait_ready(HAA_Actor **actors, int count, Uint32 timeout)
+{
+	Uint32 end = SDL_GetTicks() + timeout;
+	int ready;
+
+	while ((ready = count_ready(actors, count)) < count &&
+			SDL_GetTicks() < end) {
+		pump_events();
+		SDL_Delay(1);
+	}
+
+	return ready;
+}
+
+/** Number of reparents so far, or -1 if statistics are not available. */
+static int reparents(void)
+{
+	HAA_GlobalStats stats;
+
+	if (HAA_GetGlobalStats(&stats) != 0) return -1;
+
+	return stats.reparents;
+}
+
+/** Lets SDL_haa process events until it has reparented the actor
+  * (possibly once the new parent gets mapped) and the compositor has
+  * acknowledged it again.
+  * @return whether that happened before the timeout. */
+static bool wait_reparented(HAA_Actor *actor, int before, Uint32 timeout)
+{
+	Uint32 end = SDL_GetTicks() + timeout;
+
+	for (;;) {
+		pump_events();
+		/* Without statistics, being ready is all we can see. */
+		if ((before < 0 || reparents() > before) && HAA_IsReady(actor)) {
+			return true;
+		}
+		if (SDL_GetTicks() >= end) return false;
+		SDL_Delay(1);
+	}
+}
+
+static void bench_create_free(void)
+{
+	const int count = 200;
+	Uint64 start, pooled_start;
+	int i;
+
+	start = now_us();
+	for (i = 0; i < count; i++) {
+		HAA_Actor *actor = HAA_CreateActor(0, 64, 64, 16);
+		assert(actor);
+		HAA_FreeActor(actor);
+	}
+
+	HAA_SetActorPool(8, 1 << 20);
+	pooled_start = now_us();
+	for (i = 0; i < count; i++) {
+		HAA_Actor *actor = HAA_CreateActor(0, 64, 64, 16);
+		assert(actor);
+		HAA_FreeActor(actor);
+	}
+	HAA_SetActorPool(0, 0);
+
+	fprintf(out, "\t\"create_free_per_sec\": %.1f,\n",
+		count * 1e6 / (pooled_start - start));
+	fprintf(out, "\t\"create_free_pooled_per_sec\": %.1f,\n",
+		count * 1e6 / (now_us() - pooled_start));
+}
+
+static void bench_flips(void)
+{
+	static const struct { int w, h; } sizes[] = {
+		{ 64, 64 }, { 200, 200 }, { 800, 480 }
+	};
+	static const int depths[] = { 16, 32 };
+	unsigned int s, d;
+	bool first = true;
+
+	fprintf(out, "\t\"flips\": [\n");
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+			HAA_Actor *actor = HAA_CreateActor(0,
+				sizes[s].w, sizes[s].h, depths[d]);
+			Uint64 start, elapsed;
+			int flips = 0;
+			assert(actor);
+
+			HAA_Show(actor);
+			wait_ready(&actor, 1, 2000);
+
+			start = now_us();
+			do {
+				HAA_Flip(actor);
+				flips++;
+				elapsed = now_us() - start;
+			} while (elapsed < 500000);
+
+			fprintf(out, "%s\t\t{ \"width\": %d, \"height\": %d, \"bpp\": %d, "
+				"\"flips_per_sec\": %.1f, \"mbytes_per_sec\": %.1f }",
+				first ? "" : ",\n", sizes[s].w, sizes[s].h, depths[d],
+				flips * 1e6 / elapsed,
+				(double) flips * actor->surface->pitch * actor->surface->h /
+					elapsed);
+			first = false;
+
+			HAA_FreeActor(actor);
+		}
+	}
+	fprintf(out, "\n\t],\n");
+}
+
+static void bench_commit_latency(void)
+{
+	const int count = 1000;
+	HAA_Actor *actor = HAA_CreateActor(0, 64, 64, 16);
+	Uint64 start;
+	int i;
+	assert(actor);
+
+	HAA_Show(actor);
+	wait_ready(&actor, 1, 2000);
+
+	start = now_us();
+	for (i = 0; i < count; i++) {
+		HAA_SetPosition(actor, i % 100, 0);
+		HAA_Commit(actor);
+	}
+
+	fprintf(out, "\t\"commit_latency_us\": %.1f,\n",
+		(double) (now_us() - start) / count);
+
+	HAA_FreeActor(actor);
+}
+
+static void bench_scaling(void)
+{
+	static const int counts[] = { 1, 10, 100, 1000 };
+	const int frames = 100;
+	unsigned int c;
+	int i, f;
+
+	fprintf(out, "\t\"scaling\": [\n");
+	for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		const int n = counts[c];
+		HAA_Actor **actors = malloc(n * sizeof(HAA_Actor*));
+		Uint64 create_start, created, start;
+		int ready;
+		assert(actors);
+
+		create_start = now_us();
+		for (i = 0; i < n; i++) {
+			actors[i] = HAA_CreateActor(0, 32, 32, 16);
+			assert(actors[i]);
+			HAA_Show(actors[i]);
+		}
+		created = now_us();
+		ready = wait_ready(actors, n, 10000);
+
+		start = now_us();
+		for (f = 0; f < frames; f++) {
+			for (i = 0; i < n; i++) {
+				HAA_SetPosition(actors[i], (i * 7 + f) % 800, (i * 3) % 480);
+			}
+			HAA_CommitAll();
+		}
+
+		fprintf(out, "\t\t{ \"actors\": %d, \"ready\": %d, "
+			"\"create_us_per_actor\": %.1f, \"commit_all_us\": %.1f }%s\n",
+			n, ready, (double) (created - create_start) / n,
+			(double) (now_us() - start) / frames,
+			c == sizeof(counts) / sizeof(counts[0]) - 1 ? "" : ",");
+
+		for (i = 0; i < n; i++) {
+			HAA_FreeActor(actors[i]);
+		}
+		free(actors);
+	}
+	fprintf(out, "\t],\n");
+}
+
+static void bench_fullscreen(void)
+{
+	HAA_Actor *actor = HAA_CreateActor(0, 64, 64, 16);
+	Uint64 start, to_fs, to_windowed;
+	bool fs_done, windowed_done;
+	int before;
+	assert(actor);
+
+	HAA_Show(actor);
+	wait_ready(&actor, 1, 2000);
+
+	/* The reparent may wait until the new parent is mapped, so keep going
+	 * until it has actually happened. */
+	screen = SDL_SetVideoMode(0, 0, 16, SDL_SWSURFACE | SDL_FULLSCREEN);
+	assert(screen);
+	before = reparents();
+	start = now_us();
+	HAA_SetVideoMode();
+	fs_done = wait_reparented(actor, before, 5000);
+	to_fs = now_us() - start;
+
+	screen = SDL_SetVideoMode(0, 0, 16, SDL_SWSURFACE);
+	assert(screen);
+	before = reparents();
+	start = now_us();
+	HAA_SetVideoMode();
+	windowed_done = wait_reparented(actor, before, 5000);
+	to_windowed = now_us() - start;
+
+	fprintf(out, "\t\"reparent_fullscreen_us\": %llu,\n",
+		(unsigned long long) to_fs);
+	fprintf(out, "\t\"reparent_fullscreen_done\": %s,\n",
+		fs_done ? "true" : "false");
+	fprintf(out, "\t\"reparent_windowed_us\": %llu,\n",
+		(unsigned long long) to_windowed);
+	fprintf(out, "\t\"reparent_windowed_done\": %s,\n",
+		windowed_done ? "true" : "false");
+
+	HAA_FreeActor(actor);
+}
+
+static void write_global_stats(void)
+{
+	HAA_GlobalStats stats;
+
+	if (HAA_GetGlobalStats(&stats) != 0) {
+		fprintf(out, "\t\"stats\": null\n");
+		return;
+	}
+
+	fprintf(out, "\t\"stats\": { \"flips\": %u, \"bytes_uploaded\": %llu, "
+		"\"syncs\": %u, \"sync_time_us\": %llu, \"reparents\": %u }\n",
+		stats.actors.flips, (unsigned long long) stats.actors.bytes_uploaded,
+		stats.syncs, (unsigned long long) stats.sync_time, stats.reparents);
+}
+
+int main(int argc, char **argv)
+{
+	int res;
+	res = SDL_Init(SDL_INIT_VIDEO);
+	assert(res == 0);
+
+	res = HAA_Init(0);
+	assert(res == 0);
+
+	screen = SDL_SetVideoMode(0, 0, 16, SDL_SWSURFACE);
+	assert(screen);
+
+	out = argc > 1 ? fopen(argv[1], "w") : stdout;
+	assert(out);
+
+	fprintf(out, "{\n");
+	bench_create_free();
+	bench_flips();
+	bench_commit_latency();
+	bench_scaling();
+	bench_fullscreen();
+	write_global_stats();
+	fprintf(out, "}\n");
+
+	if (out != stdout) fclose(out);
+
+	HAA_Quit();
+	SDL_Quit();
+
+	return 0;
+}
@@ -70,11 +70,7 @@ int main()
 	HAA_SetPosition(actor3, 500, 150);
 	HAA_Show(actor3);
 	
-	res = HAA_Flip(actor1);
-	assert(res == 0);
-	res = HAA_Flip(actor2);
-	assert(res == 0);
-	res = HAA_Flip(actor3);
+	res = HAA_FlipAll();
 	assert(res == 0);
 
 	SDL_Event event;
@@ -84,22 +80,14 @@ int main()
 			case SDL_QUIT:
 				goto quit;
 			case SDL_VIDEOEXPOSE:
-				res = HAA_Flip(actor1);
-				assert(res == 0);
-				res = HAA_Flip(actor2);
-				assert(res == 0);
-				res = HAA_Flip(actor3);
+				res = HAA_FlipAll();
 				assert(res == 0);
 				break;
 			case SDL_USEREVENT:
 				HAA_SetRotation(actor1, HAA_X_AXIS, degrees, 0, 0, 0);
 				HAA_SetRotation(actor2, HAA_Y_AXIS, degrees, 0, 0, 0);
 				HAA_SetRotation(actor3, HAA_Z_AXIS, degrees, 0, 0, 0);
-				res = HAA_Commit(actor1);
-				assert(res == 0);
-				res = HAA_Commit(actor2);
-				assert(res == 0);
-				res = HAA_Commit(actor3);
+				res = HAA_CommitAll();
 				assert(res == 0);
 				break;
 		}
@@ -0,0 +1,430 @@
+/* replay - plays back a protocol trace recorded by HAA_StartTrace
+ *
+ * Usage: replay [-t] [-n] trace
+ *   -t  keep the original timing instead of replaying as fast as possible
+ *   -n  do not connect to the X server; only print the traffic summary
+ *
+ * Image uploads are replayed as plain XPutImage of blank pixels, even if
+ * they were originally sent through shared memory. Messages that referenced
+ * the application window now reference a window created by replay itself.
+ *
+ * This file is in the public domain, furnished "as is", without technical
+ * support, and with no warranty, express or implied, as to its usefulness for
+ * any purpose.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/Xatom.h>
+
+#include "../src/SDL_haa_trace.h"
+
+static char * message_names[] = {
+	"_HILDON_ANIMATION_CLIENT_MESSAGE_SHOW",
+	"_HILDON_ANIMATION_CLIENT_MESSAGE_POSITION",
+	"_HILDON_ANIMATION_CLIENT_MESSAGE_ROTATION",
+	"_HILDON_ANIMATION_CLIENT_MESSAGE_SCALE",
+	"_HILDON_ANIMATION_CLIENT_MESSAGE_ANCHOR",
+	"_HILDON_ANIMATION_CLIENT_MESSAGE_PARENT"
+};
+#define NUM_MESSAGES (sizeof(message_names) / sizeof(message_names[0]))
+
+/** A traced actor window and the one we created in its place. */
+typedef struct ReplayWindow {
+	uint32_t traced;
+	Window window;
+	Visual *visual;
+	int depth;
+	GC gc;
+} ReplayWindow;
+
+static Display *dpy;
+static Window app_window;
+static Atom message_atoms[NUM_MESSAGES];
+static Atom window_type, actor_type;
+
+static ReplayWindow *windows;
+static int num_windows, max_windows;
+
+/** Blank pixels for uploads. */
+static char *scratch;
+static size_t scratch_size;
+
+static struct {
+	unsigned long records;
+	unsigned long actors;
+	unsigned long messages[NUM_MESSAGES];
+	unsigned long uploads, clears, copies;
+	unsigned long long upload_bytes;
+	unsigned long syncs;
+	unsigned long long sync_time;
+	unsigned long long wire_bytes;
+	unsigned long long duration;
+} summary;
+
+static uint64_t now_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static ReplayWindow* find_window(uint32_t traced)
+{
+	int i;
+	for (i = 0; i < num_windows; i++) {
+		if (windows[i].traced == traced) return &windows[i];
+	}
+	return NULL;
+}
+
+static void replay_create(const HAA_TraceCreate *rec)
+{
+	int screen = DefaultScreen(dpy);
+	Window root = RootWindow(dpy, screen);
+	XSetWindowAttributes attr;
+	unsigned long attrmask = CWBorderPixel | CWBackPixel;
+	XVisualInfo vinfo;
+	ReplayWindow *w;
+
+	if (num_windows == max_windows) {
+		max_windows = max_windows ? max_windows * 2 : 16;
+		windows = realloc(windows, max_windows * sizeof(ReplayWindow));
+		if (!windows) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	w = &windows[num_windows++];
+	w->traced = rec->window;
+
+	if (!XMatchVisualInfo(dpy, screen, rec->bpp, TrueColor, &vinfo)) {
+		vinfo.visual = DefaultVisual(dpy, screen);
+		vinfo.depth = DefaultDepth(dpy, screen);
+	}
+	w->visual = vinfo.visual;
+	w->depth = vinfo.depth;
+
+	attr.background_pixel = BlackPixel(dpy, screen);
+	attr.border_pixel = attr.background_pixel;
+	if (vinfo.visual != DefaultVisual(dpy, screen)) {
+		attr.colormap = XCreateColormap(dpy, root, vinfo.visual, AllocNone);
+		attrmask |= CWColormap;
+	}
+
+	w->window = XCreateWindow(dpy, root, 0, 0, rec->width, rec->height, 0,
+		vinfo.depth, InputOutput, vinfo.visual, attrmask, &attr);
+	XChangeProperty(dpy, w->window, window_type, XA_ATOM, 32,
+		PropModeReplace, (unsigned char *) &actor_type, 1);
+	w->gc = XCreateGC(dpy, w->window, 0, NULL);
+}
+
+static void replay_destroy(ReplayWindow *w)
+{
+	XFreeGC(dpy, w->gc);
+	XDestroyWindow(dpy, w->window);
+	*w = windows[--num_windows];
+}
+
+static void replay_message(ReplayWindow *w, const HAA_TraceMessage *rec)
+{
+	XEvent event = { 0 };
+	int i;
+
+	event.xclient.type = ClientMessage;
+	event.xclient.window = w->window;
+	event.xclient.message_type = message_atoms[rec->message];
+	event.xclient.format = 32;
+	for (i = 0; i < 5; i++) {
+		event.xclient.data.l[i] = rec->data[i];
+	}
+	if (rec->message == NUM_MESSAGES - 1 && rec->data[0]) {
+		/* The traced parent window is gone; use ours. */
+		event.xclient.data.l[0] = app_window;
+	}
+
+	XSendEvent(dpy, w->window, True, StructureNotifyMask, &event);
+}
+
+static void replay_upload(ReplayWindow *w, const HAA_TraceUpload *rec)
+{
+	XImage *image;
+	size_t size;
+
+	if (rec->mode == HAA_TRACE_UPLOAD_CLEAR) {
+		XClearArea(dpy, w->window, rec->x, rec->y, rec->w, rec->h, False);
+		return;
+	} else if (rec->mode == HAA_TRACE_UPLOAD_COPY) {
+		/* The frames are not in the trace; copying the window onto itself
+		 * costs the server about the same. */
+		XCopyArea(dpy, w->window, w->window, w->gc,
+			rec->x, rec->y, rec->w, rec->h, rec->x, rec->y);
+		return;
+	}
+
+	image = XCreateImage(dpy, w->visual, w->depth, ZPixmap, 0, NULL,
+		rec->w, rec->h, 32, 0);
+	if (!image) return;
+
+	size = (size_t) image->bytes_per_line * image->height;
+	if (size > scratch_size) {
+		free(scratch);
+		scratch = calloc(1, size);
+		scratch_size = scratch ? size : 0;
+	}
+	if (scratch) {
+		image->data = scratch;
+		XPutImage(dpy, w->window, w->gc, image, 0, 0,
+			rec->x, rec->y, rec->w, rec->h);
+		image->data = NULL;
+	}
+	XDestroyImage(image);
+}
+
+/** Adds a record to the summary, estimating its size on the wire. */
+static void account(const HAA_TraceRecordHeader *header, const void *payload)
+{
+	summary.records++;
+	summary.duration += header->delta;
+
+	switch (header->type) {
+		case HAA_TRACE_CREATE:
+			summary.actors++;
+			break;
+		case HAA_TRACE_MAP:
+		case HAA_TRACE_UNMAP:
+		case HAA_TRACE_DESTROY:
+			summary.wire_bytes += 8;
+			break;
+		case HAA_TRACE_RESIZE:
+			summary.wire_bytes += 20; /* ConfigureWindow */
+			break;
+		case HAA_TRACE_MESSAGE: {
+			const HAA_TraceMessage *rec = payload;
+			if (rec->message < NUM_MESSAGES) {
+				summary.messages[rec->message]++;
+			}
+			summary.wire_bytes += 44; /* SendEvent */
+			break;
+		}
+		case HAA_TRACE_UPLOAD: {
+			const HAA_TraceUpload *rec = payload;
+			unsigned long long row = ((unsigned long) rec->w * rec->bpp / 8 + 3) & ~3UL;
+			switch (rec->mode) {
+				case HAA_TRACE_UPLOAD_PUT:
+					summary.uploads++;
+					summary.upload_bytes += row * rec->h;
+					summary.wire_bytes += 24 + row * rec->h;
+					break;
+				case HAA_TRACE_UPLOAD_SHM:
+					summary.uploads++;
+					summary.upload_bytes += row * rec->h;
+					summary.wire_bytes += 40; /* ShmPutImage */
+					break;
+				case HAA_TRACE_UPLOAD_CLEAR:
+					summary.clears++;
+					summary.wire_bytes += 16;
+					break;
+				case HAA_TRACE_UPLOAD_COPY:
+					summary.copies++;
+					summary.wire_bytes += 28; /* CopyArea */
+					break;
+			}
+			break;
+		}
+		case HAA_TRACE_SYNC: {
+			const HAA_TraceSync *rec = payload;
+			summary.syncs++;
+			summary.sync_time += rec->duration;
+			summary.wire_bytes += 4 + 32; /* GetInputFocus and its reply */
+			break;
+		}
+	}
+}
+
+static void replay(const HAA_TraceRecordHeader *header, const void *payload)
+{
+	ReplayWindow *w = NULL;
+
+	if (header->type == HAA_TRACE_CREATE) {
+		if (header->size >= sizeof(HAA_TraceCreate)) {
+			replay_create(payload);
+		}
+		return;
+	}
+	if (header->type == HAA_TRACE_SYNC) {
+		XSync(dpy, False);
+		return;
+	}
+
+	/* Everything else starts with the window. */
+	if (header->size < sizeof(uint32_t)) return;
+	w = find_window(*(const uint32_t *) payload);
+	if (!w) return;
+
+	switch (header->type) {
+		case HAA_TRACE_DESTROY:
+			replay_destroy(w);
+			break;
+		case HAA_TRACE_MAP:
+			XMapWindow(dpy, w->window);
+			break;
+		case HAA_TRACE_UNMAP:
+			XUnmapWindow(dpy, w->window);
+			break;
+		case HAA_TRACE_RESIZE:
+			if (header->size >= sizeof(HAA_TraceResize)) {
+				const HAA_TraceResize *rec = payload;
+				XResizeWindow(dpy, w->window, rec->width, rec->height);
+			}
+			break;
+		case HAA_TRACE_MESSAGE:
+			if (header->size >= sizeof(HAA_TraceMessage) &&
+					((const HAA_TraceMessage *) payload)->message < NUM_MESSAGES) {
+				replay_message(w, payload);
+			}
+			break;
+		case HAA_TRACE_UPLOAD:
+			if (header->size >= sizeof(HAA_TraceUpload)) {
+				replay_upload(w, payload);
+			}
+			break;
+	}
+}
+
+static void print_summary(unsigned long long replay_time)
+{
+	static const char * names[] = {
+		"show", "position", "rotation", "scale", "anchor", "parent"
+	};
+	unsigned int i;
+
+	printf("records:       %lu\n", summary.records);
+	printf("duration:      %.3f s\n", summary.duration / 1e6);
+	printf("actors:        %lu\n", summary.actors);
+	for (i = 0; i < NUM_MESSAGES; i++) {
+		printf("%-14s %lu\n", names[i], summary.messages[i]);
+	}
+	printf("uploads:       %lu (%llu bytes)\n",
+		summary.uploads, summary.upload_bytes);
+	printf("clears:        %lu\n", summary.clears);
+	printf("copies:        %lu\n", summary.copies);
+	printf("syncs:         %lu (%.3f s waiting)\n",
+		summary.syncs, summary.sync_time / 1e6);
+	printf("wire bytes:    %llu\n", summary.wire_bytes);
+	if (replay_time) {
+		printf("replayed in:   %.3f s\n", replay_time / 1e6);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int timed = 0, dry_run = 0, opt;
+	HAA_TraceHeader header;
+	uint64_t start, clock_us = 0;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "tn")) != -1) {
+		switch (opt) {
+			case 't': timed = 1; break;
+			case 'n': dry_run = 1; break;
+			default:
+				fprintf(stderr, "Usage: %s [-t] [-n] trace\n", argv[0]);
+				return 2;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "Usage: %s [-t] [-n] trace\n", argv[0]);
+		return 2;
+	}
+
+	f = fopen(argv[optind], "rb");
+	if (!f) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+			memcmp(header.magic, HAA_TRACE_MAGIC, 4) != 0) {
+		fprintf(stderr, "%s: not a SDL_haa trace\n", argv[optind]);
+		return 1;
+	}
+	if (header.byte_order != HAA_TRACE_BYTE_ORDER) {
+		fprintf(stderr, "%s: recorded on a machine with another byte order\n",
+			argv[optind]);
+		return 1;
+	}
+	/* Newer versions only add to older ones. */
+	if (header.version == 0 || header.version > HAA_TRACE_VERSION) {
+		fprintf(stderr, "%s: unsupported trace version %u\n",
+			argv[optind], header.version);
+		return 1;
+	}
+
+	if (!dry_run) {
+		dpy = XOpenDisplay(NULL);
+		if (!dpy) {
+			fprintf(stderr, "Cannot open display\n");
+			return 1;
+		}
+		XInternAtoms(dpy, message_names, NUM_MESSAGES, False, message_atoms);
+		window_type = XInternAtom(dpy, "_NET_WM_WINDOW_TYPE", False);
+		actor_type = XInternAtom(dpy,
+			"_HILDON_WM_WINDOW_TYPE_ANIMATION_ACTOR", False);
+
+		/* Stands in for the traced application window. */
+		app_window = XCreateSimpleWindow(dpy, DefaultRootWindow(dpy),
+			0, 0, DisplayWidth(dpy, DefaultScreen(dpy)),
+			DisplayHeight(dpy, DefaultScreen(dpy)), 0, 0, 0);
+		XStoreName(dpy, app_window, "replay");
+		XMapWindow(dpy, app_window);
+		XSync(dpy, False);
+	}
+
+	start = now_us();
+	for (;;) {
+		HAA_TraceRecordHeader rec;
+		uint32_t payload[256 / sizeof(uint32_t)]; /* aligned for the casts */
+
+		if (fread(&rec, sizeof(rec), 1, f) != 1) break;
+		if (rec.size && fread(payload, rec.size, 1, f) != 1) break;
+		/* Fields missing from shorter records read as zero. */
+		memset((char *) payload + rec.size, 0, sizeof(payload) - rec.size);
+
+		account(&rec, payload);
+		if (dry_run) continue;
+
+		clock_us += rec.delta;
+		if (timed) {
+			uint64_t elapsed = now_us() - start;
+			if (clock_us > elapsed) {
+				XFlush(dpy);
+				usleep(clock_us - elapsed);
+			}
+		}
+
+		replay(&rec, payload);
+	}
+	fclose(f);
+
+	if (!dry_run) {
+		XSync(dpy, False);
+	}
+	print_summary(dry_run ? 0 : now_us() - start);
+
+	if (!dry_run) {
+		while (num_windows > 0) {
+			replay_destroy(&windows[num_windows - 1]);
+		}
+		XCloseDisplay(dpy);
+	}
+	free(windows);
+	free(scratch);
+
+	return 0;
+}
@@ -0,0 +1,188 @@
+/* stubwm - a stand-in for hildon-desktop, just enough to benchmark SDL_haa
+ *
+ * It marks every animation actor window as ready as soon as it is mapped
+ * and counts the animation actor messages it receives. When terminated,
+ * it writes those counts as JSON to the file given as first argument
+ * (or stdout). Once it is watching for actors, it creates the file given
+ * as second argument, if any, so that scripts know when to start.
+ *
+ * This file is in the public domain, furnished "as is", without technical
+ * support, and with no warranty, express or implied, as to its usefulness for
+ * any purpose.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/select.h>
+#include <unistd.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+
+enum {
+	ATOM_NET_WM_WINDOW_TYPE,
+	ATOM_ANIMATION_ACTOR,
+	ATOM_CLIENT_READY,
+	ATOM_FIRST_MESSAGE,
+	ATOM_MESSAGE_SHOW = ATOM_FIRST_MESSAGE,
+	ATOM_MESSAGE_POSITION,
+	ATOM_MESSAGE_ROTATION,
+	ATOM_MESSAGE_SCALE,
+	ATOM_MESSAGE_ANCHOR,
+	ATOM_MESSAGE_PARENT,
+	ATOM_COUNT
+};
+
+static char * atom_names[] = {
+	"_NET_WM_WINDOW_TYPE",
+	"_HILDON_WM_WINDOW_TYPE_ANIMATION_ACTOR",
+	"_HILDON_ANIMATION_CLIENT_READY",
+	"_HILDON_ANIMATION_CLIENT_MESSAGE_SHOW",
+	"_HILDON_ANIMATION_CLIENT_MESSAGE_POSITION",
+	"_HILDON_ANIMATION_CLIENT_MESSAGE_ROTATION",
+	"_HILDON_ANIMATION_CLIENT_MESSAGE_SCALE",
+	"_HILDON_ANIMATION_CLIENT_MESSAGE_ANCHOR",
+	"_HILDON_ANIMATION_CLIENT_MESSAGE_PARENT"
+};
+
+static Atom atoms[ATOM_COUNT];
+
+static unsigned long actors_seen;
+static unsigned long messages[ATOM_COUNT];
+
+static volatile sig_atomic_t quit = 0;
+
+static void on_signal(int sig)
+{
+	(void) sig;
+	quit = 1;
+}
+
+static int is_animation_actor(Display *dpy, Window w)
+{
+	Atom actual_type;
+	int actual_format;
+	unsigned long nitems, bytes_after;
+	unsigned char *prop = NULL;
+	int res = 0;
+
+	if (XGetWindowProperty(dpy, w, atoms[ATOM_NET_WM_WINDOW_TYPE], 0, 1,
+			False, XA_ATOM, &actual_type, &actual_format,
+			&nitems, &bytes_after, &prop) == Success && prop) {
+		res = actual_type == XA_ATOM && nitems == 1 &&
+			*(Atom*)prop == atoms[ATOM_ANIMATION_ACTOR];
+	}
+	if (prop) XFree(prop);
+
+	return res;
+}
+
+static int ignore_errors(Display *dpy, XErrorEvent *e)
+{
+	/* Windows come and go; they may be gone before we look at them. */
+	(void) dpy;
+	(void) e;
+	return 0;
+}
+
+static void write_report(const char *path)
+{
+	static const char * names[] = {
+		"show", "position", "rotation", "scale", "anchor", "parent"
+	};
+	FILE *f = path ? fopen(path, "w") : stdout;
+	int i;
+
+	if (!f) {
+		perror(path);
+		return;
+	}
+
+	fprintf(f, "{\n\t\"actors\": %lu,\n\t\"messages\": {\n", actors_seen);
+	for (i = ATOM_FIRST_MESSAGE; i < ATOM_COUNT; i++) {
+		fprintf(f, "\t\t\"%s\": %lu%s\n", names[i - ATOM_FIRST_MESSAGE],
+			messages[i], i == ATOM_COUNT - 1 ? "" : ",");
+	}
+	fprintf(f, "\t}\n}\n");
+
+	if (f != stdout) fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	Display *dpy = XOpenDisplay(NULL);
+	int i;
+
+	/* The X server may still be starting up. */
+	for (i = 0; !dpy && i < 50; i++) {
+		usleep(100000);
+		dpy = XOpenDisplay(NULL);
+	}
+	if (!dpy) {
+		fprintf(stderr, "Cannot open display\n");
+		return 1;
+	}
+
+	signal(SIGTERM, on_signal);
+	signal(SIGINT, on_signal);
+	XSetErrorHandler(ignore_errors);
+
+	XInternAtoms(dpy, atom_names, ATOM_COUNT, False, atoms);
+	XSelectInput(dpy, DefaultRootWindow(dpy), SubstructureNotifyMask);
+	XSync(dpy, False);
+
+	if (argc > 2) {
+		FILE *f = fopen(argv[2], "w");
+		if (!f) {
+			perror(argv[2]);
+			return 1;
+		}
+		fclose(f);
+	}
+
+	while (!quit) {
+		XEvent e;
+
+		if (!XPending(dpy)) {
+			/* Wait for events, but wake up to notice signals. */
+			struct timeval tv = { 0, 100000 };
+			fd_set fds;
+			FD_ZERO(&fds);
+			FD_SET(ConnectionNumber(dpy), &fds);
+			select(ConnectionNumber(dpy) + 1, &fds, NULL, NULL, &tv);
+			continue;
+		}
+
+		XNextEvent(dpy, &e);
+		switch (e.type) {
+			case MapNotify:
+				if (is_animation_actor(dpy, e.xmap.window)) {
+					Atom ready = atoms[ATOM_CLIENT_READY];
+					/* Messages are sent to the actor window
+					 * with StructureNotifyMask. */
+					XSelectInput(dpy, e.xmap.window, StructureNotifyMask);
+					XChangeProperty(dpy, e.xmap.window, ready,
+						XA_ATOM, 32, PropModeReplace,
+						(unsigned char *) &ready, 1);
+					XFlush(dpy);
+					actors_seen++;
+				}
+				break;
+			case ClientMessage:
+				for (i = ATOM_FIRST_MESSAGE; i < ATOM_COUNT; i++) {
+					if (e.xclient.message_type == atoms[i]) {
+						messages[i]++;
+						break;
+					}
+				}
+				break;
+		}
+	}
+
+	write_report(argc > 1 ? argv[1] : NULL);
+	XCloseDisplay(dpy);
+
+	return 0;
+}